@@ -8,13 +8,31 @@
 
 #include <dev/sound/pcm/sound.h>
 #include <dev/sound/pcm/ac97.h>
+#include <dev/sound/pcm/vchan.h>
+#include <dev/sound/midi/mpu401.h>
 
 #include <sys/sysctl.h>
+#include <sys/proc.h>
+#include <sys/taskqueue.h>
+#include <sys/callout.h>
 #include <sys/endian.h>
+#include <sys/conf.h>
+#include <sys/mman.h>
+#if defined(__FreeBSD__)
+#include <sys/devctl.h>
+#endif
+
+#include <vm/vm.h>
+#include <vm/pmap.h>
+#include <vm/vm_extern.h>
+#include <vm/vm_object.h>
+#include <vm/vm_page.h>
 
 #include "xonar.h"
 #include "xonar_io.h"
+#include "xonar_status.h"
 #include "mixer_if.h"
+#include "mpufoi_if.h"
 
 #define CHAN_STATE_INIT     0
 #define CHAN_STATE_ACTIVE   1
@@ -34,34 +52,20 @@
         /* flags */ 0, /* lock fn */ busdma_lock_mutex,                 \
         /* lock */ lock, /* result */ tag)
 
-#define OUTPUT_LINE         0
-#define OUTPUT_REAR_HP      1
-#define OUTPUT_HP       2
 static char *output_str[] = {"Line-Out", "RearHeadphones", "Headphones"};
 static char *rolloff_str[] = {"sharp", "slow"};
+static char *monitor_src_str[] = {"line", "mic", "spdif"};
+static char *dma_mem_str[] = {"cached", "coherent", "wc"};
 
 static int xonar_init(struct xonar_info *);
 static void xonar_cleanup(struct xonar_info *);
 
 static int cmi8788_get_output(struct xonar_info *sc);
-static void cmi8788_set_output(struct xonar_info *sc, int which);
-
-static const struct {
-    uint16_t vendor;
-    uint16_t devid;
-    char *desc;
-} xonar_hw[] = {
-    /* we actually support only this one, it shouldn't be too hard to add others */
-    { ASUS_VENDOR_ID, SUBID_XONAR_STX, "Asus Xonar Essence STX (AV100)"     },
-    { ASUS_VENDOR_ID, SUBID_XONAR_ST,  "Asus Xonar Essence ST (AV100)"  },
-#if 0
-    { ASUS_VENDOR_ID, SUBID_XONAR_D1,  "Asus Xonar D1 (AV100)"      },
-    { ASUS_VENDOR_ID, SUBID_XONAR_DX,  "Asus Xonar DX (AV100)"      },
-    { ASUS_VENDOR_ID, SUBID_XONAR_D2,  "Asus Xonar D2 (AV200)"      },
-    { ASUS_VENDOR_ID, SUBID_XONAR_D2X, "Asus Xonar D2X (AV200)"         },
-    { ASUS_VENDOR_ID, SUBID_XONAR_DS,  "Asus Xonar DS (AV66)"       },
-#endif
-};
+static int cmi8788_set_output(struct xonar_info *sc, int which);
+static void xonar_status_output(struct xonar_info *sc, int which);
+static int xonar_chan_ptr_reg(struct xonar_chinfo *ch);
+static void xonar_add_pcm(struct xonar_info *sc, int port);
+static driver_t cmi8788_driver;
 
 static u_int32_t xonar_fmt[] = {
     SND_FORMAT(AFMT_S16_LE, 2, 0),
@@ -70,19 +74,128 @@ static u_int32_t xonar_fmt[] = {
     0
 };
 
+static u_int32_t xonar_fmt_multich[] = {
+    SND_FORMAT(AFMT_S16_LE, 2, 0),
+    SND_FORMAT(AFMT_S16_LE, 4, 0),
+    SND_FORMAT(AFMT_S16_LE, 6, 1),
+    SND_FORMAT(AFMT_S16_LE, 8, 1),
+    SND_FORMAT(AFMT_S24_LE, 2, 0),
+    SND_FORMAT(AFMT_S24_LE, 4, 0),
+    SND_FORMAT(AFMT_S24_LE, 6, 1),
+    SND_FORMAT(AFMT_S24_LE, 8, 1),
+    SND_FORMAT(AFMT_S32_LE, 2, 0),
+    SND_FORMAT(AFMT_S32_LE, 4, 0),
+    SND_FORMAT(AFMT_S32_LE, 6, 1),
+    SND_FORMAT(AFMT_S32_LE, 8, 1),
+    0
+};
+
 #define XONAR_DEBUG(format, ...) if (sc->debug) device_printf (sc->dev, format, ##__VA_ARGS__)
 
-static struct pcmchan_caps xonar_caps = { 32000, 192000, xonar_fmt, 0 };
+/* Native rates, indexed by I2S_FMT_RATE* */
+static int xonar_rates[] = {
+    32000, 44100, 48000, 64000, 88200, 96000, 176400, 192000
+};
+#define XONAR_RATE_MIN  32000
+#define XONAR_RATE_MAX  192000
+
+/* IEC 60958 channel status sampling frequency codes, same order */
+static const uint8_t spdif_cs_rates[] = {
+    0x3, 0x0, 0x2, 0xb, 0x8, 0xa, 0xc, 0xe
+};
+
+/* AFMT_AC3 also carries DTS and other IEC 61937 bitstreams */
+static u_int32_t xonar_fmt_spdif[] = {
+    SND_FORMAT(AFMT_S16_LE, 2, 0),
+    SND_FORMAT(AFMT_S32_LE, 2, 0),
+    SND_FORMAT(AFMT_AC3, 2, 0),
+    0
+};
+
+static u_int32_t xonar_fmt_spdif_in[] = {
+    SND_FORMAT(AFMT_S16_LE, 2, 0),
+    SND_FORMAT(AFMT_S32_LE, 2, 0),
+    0
+};
+
+/* AC97 links run at a fixed 48kHz, 16 bit */
+static u_int32_t xonar_fmt_ac97[] = {
+    SND_FORMAT(AFMT_S16_LE, 2, 0),
+    0
+};
+
+static int xonar_rate_ac97 = 48000;
+
+/*
+ * Caps can only hold a range, which is clamped to before setspeed. The
+ * rates in between that are actually offered are those of getrates,
+ * setspeed snaps to them and the sound system resamples the rest.
+ */
+static struct pcmchan_caps xonar_caps = {
+    XONAR_RATE_MIN, XONAR_RATE_MAX, xonar_fmt, 0
+};
+static struct pcmchan_caps xonar_caps_multich = {
+    XONAR_RATE_MIN, XONAR_RATE_MAX, xonar_fmt_multich, 0
+};
+static struct pcmchan_caps xonar_caps_spdif = {
+    XONAR_RATE_MIN, XONAR_RATE_MAX, xonar_fmt_spdif, 0
+};
+static struct pcmchan_caps xonar_caps_ac97 = { 48000, 48000, xonar_fmt_ac97, 0 };
+
+/*
+ * ST/STX have one PCM1796 on I2C, D2/D2X have four of them on SPI.
+ * SPI is write-only, so registers of all DACs are cached. The SPI chip
+ * selects of the four DACs, as wired on the D2/D2X (same as Linux
+ * snd-oxygen).
+ */
+static const uint8_t pcm1796_spi_codec_map[PCM1796_MAX_DACS] = { 0, 1, 2, 4 };
+
+static int
+pcm1796_queue (struct xonar_info *sc, struct cmi8788_spi_batch *batch,
+               int dac, uint8_t reg, uint8_t data)
+{
+    sc->pcm1796_regs[dac][reg - PCM1796_REG_BASE] = data;
+    if (sc->hw->dac_bus == XONAR_BUS_I2C)
+        return cmi8788_write_i2c (sc, sc->hw->front_dac, reg, data);
+
+    return cmi8788_spi_batch_add (batch, SPI_TRIGGER | SPI_DATA_LENGTH_2 |
+                                  SPI_CLOCK_160 | SPI_CEN_LATCH_CLOCK_HI |
+                                  (pcm1796_spi_codec_map[dac] << SPI_CODEC_SHIFT),
+                                  (reg << 8) | data);
+}
+
+/* Write the same value to a register of all DACs in one transaction */
+static int
+pcm1796_write (struct xonar_info *sc, uint8_t reg, uint8_t data)
+{
+    struct cmi8788_spi_batch batch;
+    int i, res = 0;
+
+    cmi8788_spi_batch_init (&batch);
+    for (i = 0; i < sc->pcm1796_dacs; i++)
+        res |= pcm1796_queue (sc, &batch, i, reg, data);
+    return res | cmi8788_spi_batch_flush (sc, &batch);
+}
 
-/* ST/STX only. Do we have pcm1796 in other cards? */
-static int pcm1796_write (struct xonar_info *sc, uint8_t reg, uint8_t data)
+static int
+pcm1796_read (struct xonar_info *sc, uint8_t reg)
 {
-    return cmi8788_write_i2c (sc, XONAR_STX_FRONTDAC, reg, data);
+    return sc->pcm1796_regs[0][reg - PCM1796_REG_BASE];
 }
 
-static int pcm1796_read (struct xonar_info *sc, uint8_t reg)
+/* Replay the cached registers 16-20 of all DACs in one transaction */
+static void
+pcm1796_resume (struct xonar_info *sc)
 {
-    return cmi8788_read_i2c (sc, XONAR_STX_FRONTDAC, reg);
+    struct cmi8788_spi_batch batch;
+    int i, reg;
+
+    cmi8788_spi_batch_init (&batch);
+    for (i = 0; i < sc->pcm1796_dacs; i++)
+        for (reg = 16; reg <= 20; reg++)
+            pcm1796_queue (sc, &batch, i, reg,
+                           sc->pcm1796_regs[i][reg - PCM1796_REG_BASE]);
+    cmi8788_spi_batch_flush (sc, &batch);
 }
 
 static int
@@ -105,8 +218,96 @@ static kobj_method_t xonar_ac97_methods[] = {
 };
 AC97_DECLARE(xonar_ac97);
 
+/*
+ * MPU-401 UART at MPU401_DATA. midi(4) queues the bytes; received ones
+ * are also put in midi_events with the time of the interrupt that
+ * brought them. mpu_intr only runs under the softc lock, from
+ * xonar_intr() or xonar_midi_kick(), which covers the ring and midi_time.
+ */
+static unsigned char
+xonar_midi_read(struct mpu401 *arg, void *cookie, int reg)
+{
+    struct xonar_info *sc = cookie;
+    struct xonar_midi_event *ev;
+    unsigned char b;
+    u_int head;
+
+    b = cmi8788_read_1(sc, MPU401_DATA + reg);
+    if (reg != 0)
+        return b;
+
+    head = sc->midi_head;
+    if (head - sc->midi_tail >= XONAR_MIDI_EVENTS) {
+        sc->midi_overruns++;
+        return b;
+    }
+    ev = &sc->midi_events[head & (XONAR_MIDI_EVENTS - 1)];
+    ev->time = sbttons(sc->midi_time ? sc->midi_time : sbinuptime());
+    ev->data = b;
+    sc->midi_head = head + 1;
+    return b;
+}
+
+static void
+xonar_midi_write(struct mpu401 *arg, void *cookie, int reg, unsigned char b)
+{
+    struct xonar_info *sc = cookie;
+
+    cmi8788_write_1(sc, MPU401_DATA + reg, b);
+}
+
+static int
+xonar_midi_uninit(struct mpu401 *arg, void *cookie)
+{
+    struct xonar_info *sc = cookie;
+
+    snd_mtxlock(sc->lock);
+    cmi8788_setandclear_2(sc, IRQ_MASK, 0, IRQ_MIDI);
+    sc->mpu_intr = NULL;
+    sc->mpu = NULL;
+    snd_mtxunlock(sc->lock);
+    return 0;
+}
+
+/* midi(4) calls this from a callout to push out bytes it just queued */
+static void
+xonar_midi_kick(void *arg)
+{
+    struct xonar_info *sc = arg;
+
+    snd_mtxlock(sc->lock);
+    if (sc->mpu_intr != NULL)
+        sc->mpu_intr(sc->mpu);
+    snd_mtxunlock(sc->lock);
+}
+
+static kobj_method_t xonar_mpu_methods[] = {
+    KOBJMETHOD(mpufoi_read,     xonar_midi_read),
+    KOBJMETHOD(mpufoi_write,    xonar_midi_write),
+    KOBJMETHOD(mpufoi_uninit,   xonar_midi_uninit),
+    KOBJMETHOD_END
+};
+static DEFINE_CLASS(xonar_mpu, xonar_mpu_methods, 0);
+
+/* Attach the MPU-401 to midi(4), if the card has it enabled */
+static void
+xonar_midi_attach(struct xonar_info *sc)
+{
+    if (!(cmi8788_read_1 (sc, MISC_REG) & MISC_MIDI))
+        return;
+    sc->mpu = mpu401_init(&xonar_mpu_class, sc, xonar_midi_kick,
+                          &sc->mpu_intr);
+    if (sc->mpu != NULL)
+        cmi8788_setandclear_2 (sc, IRQ_MASK, IRQ_MIDI, 0);
+}
+
+/*
+ * Map the volume and pcm mixer levels to a DAC level in 0.5dB steps,
+ * 255 being 0dB. pcm follows the same slope as volume without the
+ * offset, so the two attenuations simply add up in dB.
+ */
 static unsigned int
-pcm1796_vol_scale(struct xonar_info *sc, int vol)
+xonar_vol_scale(struct xonar_info *sc, int vol, int pcm)
 {
     int offset, scale;
     int which = cmi8788_get_output(sc);
@@ -128,19 +329,22 @@ pcm1796_vol_scale(struct xonar_info *sc, int vol)
         offset = 0;
         scale = 255;
     }
-    return offset + vol*scale/100;
+    if (pcm == 0)
+        return 0;
+    return imax(offset + vol*scale/100 - (100 - pcm)*scale/100, 0);
 }
 
 static void
 pcm1796_set_volume(struct xonar_info *sc, int left, int right)
 {
-    int l, r, too_high = 0;
+    struct cmi8788_spi_batch batch;
+    int l, r, i, too_high = 0;
 
     sc->vol[0] = left;
     sc->vol[1] = right;
 
-    l = pcm1796_vol_scale(sc, left);
-    r = pcm1796_vol_scale(sc, right);
+    l = xonar_vol_scale(sc, left, sc->pcm_vol[0]);
+    r = xonar_vol_scale(sc, right, sc->pcm_vol[1]);
 
     if (l & ~(int)0xff) {
         too_high = 1;
@@ -152,8 +356,13 @@ pcm1796_set_volume(struct xonar_info *sc, int left, int right)
     }
 
     if (too_high) device_printf (sc->dev, "volume offset and scale are set too high");
-    pcm1796_write(sc, 16, l);
-    pcm1796_write(sc, 17, r);
+
+    cmi8788_spi_batch_init (&batch);
+    for (i = 0; i < sc->pcm1796_dacs; i++) {
+        pcm1796_queue(sc, &batch, i, 16, l);
+        pcm1796_queue(sc, &batch, i, 17, r);
+    }
+    cmi8788_spi_batch_flush (sc, &batch);
 }
 
 static int
@@ -222,246 +431,725 @@ pcm1796_set_rolloff(struct xonar_info *sc, int rolloff)
     return res;
 }
 
-static void
-cmi8788_toggle_sound(struct xonar_info *sc, int output) {
-    if (output) {
-        cmi8788_setandclear_2 (sc, GPIO_CONTROL, sc->output_control_gpio, 0);
-        tsleep (sc, 0, "apop", sc->anti_pop_delay);
-        cmi8788_setandclear_2 (sc, GPIO_DATA, sc->output_control_gpio, 0);
-    } else {
-        cmi8788_setandclear_2 (sc, GPIO_DATA, 0, sc->output_control_gpio);
-        tsleep (sc, 0, "apop", sc->anti_pop_delay);
-    }
+/*
+ * D1/DX: CS4398 front DAC and CS4362A surround DAC.
+ * Both are write-only, so we keep their registers cached.
+ */
+static int
+cs4398_write(struct xonar_info *sc, uint8_t reg, uint8_t data)
+{
+    sc->cs4398_regs[reg] = data;
+    return cmi8788_write_i2c (sc, sc->hw->front_dac, reg, data);
+}
+
+static int
+cs4362a_write(struct xonar_info *sc, uint8_t reg, uint8_t data)
+{
+    sc->cs4362a_regs[reg] = data;
+    return cmi8788_write_i2c (sc, sc->hw->surr_dac, reg, data);
+}
+
+/* Write a register only if it differs from the cached value */
+static int
+cs4398_update(struct xonar_info *sc, uint8_t reg, uint8_t data)
+{
+    if (sc->cs4398_regs[reg] == data)
+        return 0;
+    return cs4398_write (sc, reg, data);
 }
 
-/* Bits in monitor register are not clear for me,
-   but I think it is enough to set it to 0xf */
 static int
-cmi8788_get_rec_monitor(struct xonar_info *sc)
+cs4362a_update(struct xonar_info *sc, uint8_t reg, uint8_t data)
 {
-    return (cmi8788_read_1 (sc, REC_MONITOR) & 0x0f) ? 1: 0;
+    if (sc->cs4362a_regs[reg] == data)
+        return 0;
+    return cs4362a_write (sc, reg, data);
 }
 
+static const uint8_t cs4362a_mix_regs[] = {
+    CS4362A_MIX1_CTRL, CS4362A_MIX2_CTRL, CS4362A_MIX3_CTRL
+};
+
+/* Left channel volume registers come first, right ones follow */
+static const uint8_t cs4362a_vol_regs[] = {
+    CS4362A_VOLA_1, CS4362A_VOLA_2, CS4362A_VOLA_3,
+    CS4362A_VOLB_1, CS4362A_VOLB_2, CS4362A_VOLB_3
+};
+
 static void
-cmi8788_set_rec_monitor(struct xonar_info *sc, int set)
+pcm1796_set_rate(struct xonar_info *sc, int speed)
 {
-    if (set) cmi8788_setandclear_1 (sc, REC_MONITOR, 0x0f, 0);
-    else cmi8788_setandclear_1 (sc, REC_MONITOR, 0, 0x0f);
+    uint8_t os = (speed <= 88000) ? PCM1796_OS_64 : PCM1796_OS_32;
+
+    if (pcm1796_read(sc, 20) != os)
+        pcm1796_write(sc, 20, os);
 }
 
+/* OPE disables the DAC outputs, which is as far down as it goes */
 static void
-cmi8788_set_output(struct xonar_info *sc, int which)
+pcm1796_set_power(struct xonar_info *sc, int on)
 {
-    cmi8788_toggle_sound(sc, 0);
-    switch (sc->model) {
-    case SUBID_XONAR_ST:
-    case SUBID_XONAR_STX:
-        /*
-         * GPIO1 - front (0) or rear (1) HP jack
-         * GPIO7 - speakers (0) or HP (1)
-         */
-        switch (which) {
-        case OUTPUT_LINE:
-            cmi8788_setandclear_2 (sc, GPIO_DATA, 0, GPIO_PIN7|GPIO_PIN1);
-            break;
-        case OUTPUT_REAR_HP:
-            cmi8788_setandclear_2 (sc, GPIO_DATA, GPIO_PIN7|GPIO_PIN1, 0);
-            break;
-        case OUTPUT_HP:
-            cmi8788_setandclear_2 (sc, GPIO_DATA, GPIO_PIN7, GPIO_PIN1);
-            break;
-        }
-        break;
-    }
-    pcm1796_set_volume (sc, sc->vol[0], sc->vol[1]);
-    cmi8788_toggle_sound(sc, 1);
+    int val = pcm1796_read(sc, 19);
+    int ope = on ? (val & ~PCM1796_OPE) : (val | PCM1796_OPE);
+
+    if (ope != val)
+        pcm1796_write(sc, 19, ope);
 }
 
-static int
-cmi8788_get_output(struct xonar_info *sc)
+static void
+cs43xx_init(struct xonar_info *sc)
 {
-    uint16_t val;
-    int res = 0;
-
-    switch (sc->model) {
-    case SUBID_XONAR_ST:
-    case SUBID_XONAR_STX:
-        val = cmi8788_read_2(sc, GPIO_DATA);
-        if (!(val & GPIO_PIN7)) res = OUTPUT_LINE;
-        else if (! (val & GPIO_PIN1)) res = OUTPUT_HP;
-        else res = OUTPUT_REAR_HP;
-        break;
-    }
+    int i;
 
-    return res;
+    /* Enable control port and keep DACs powered down while configuring */
+    cs4398_write(sc, CS4398_MISC_CTRL, CS4398_CPEN | CS4398_POWER_DOWN);
+    cs4362a_write(sc, CS4362A_MODE1_CTRL, CS4362A_CPEN | CS4362A_POWER_DOWN);
+
+    cs4398_write(sc, CS4398_MODE_CTRL, CS4398_FM_SINGLE | CS4398_DIF_LJUST);
+    cs4398_write(sc, CS4398_MIXING, CS4398_ATAPI_B_R | CS4398_ATAPI_A_L);
+    cs4398_write(sc, CS4398_MUTE_CTRL, CS4398_MUTEP_LOW | CS4398_PAMUTE);
+    cs4398_write(sc, CS4398_VOLA, CS4398_VOL(0));
+    cs4398_write(sc, CS4398_VOLB, CS4398_VOL(0));
+    cs4398_write(sc, CS4398_RAMP_CTRL, CS4398_RMP_DN | CS4398_RMP_UP |
+                 CS4398_ZERO_CROSS | CS4398_SOFT_RAMP);
+
+    cs4362a_write(sc, CS4362A_MODE2_CTRL, CS4362A_DIF_LJUST);
+    cs4362a_write(sc, CS4362A_MODE3_CTRL, CS4362A_RAMP_SOFTZERO |
+                  CS4362A_AUTOMUTE | CS4362A_SIX_MUTE);
+    cs4362a_write(sc, CS4362A_FILTER_CTRL, CS4362A_RAMPDOWN | CS4362A_DEM_NONE);
+    cs4362a_write(sc, CS4362A_INVERT_CTRL, 0);
+    for (i = 0; i < ARRAY_SIZE (cs4362a_mix_regs); i++)
+        cs4362a_write(sc, cs4362a_mix_regs[i], CS4362A_FM_SINGLE |
+                      CS4362A_ATAPI_B_R | CS4362A_ATAPI_A_L);
+    for (i = 0; i < ARRAY_SIZE (cs4362a_vol_regs); i++)
+        cs4362a_write(sc, cs4362a_vol_regs[i], CS4362A_VOL(0));
+
+    /* Power up */
+    cs4398_write(sc, CS4398_MISC_CTRL, CS4398_CPEN);
+    cs4362a_write(sc, CS4362A_MODE1_CTRL, CS4362A_CPEN);
 }
 
-static void 
-xonar_chan_reset(struct xonar_chinfo *ch, uint8_t which)
+/* Registers cs43xx_init() sets up, other than the power controls */
+static const uint8_t cs4398_resume_regs[] = {
+    CS4398_MODE_CTRL, CS4398_MIXING, CS4398_MUTE_CTRL,
+    CS4398_VOLA, CS4398_VOLB, CS4398_RAMP_CTRL
+};
+static const uint8_t cs4362a_resume_regs[] = {
+    CS4362A_MODE2_CTRL, CS4362A_MODE3_CTRL, CS4362A_FILTER_CTRL,
+    CS4362A_INVERT_CTRL
+};
+
+/* Same sequence as cs43xx_init(), but from the cached registers */
+static void
+cs43xx_resume(struct xonar_info *sc)
 {
-    struct xonar_info *sc = ch->parent;
+    int i;
 
-    cmi8788_setandclear_1 (sc, CHAN_RESET, which, 0);
-    DELAY(10);
-    cmi8788_setandclear_1 (sc, CHAN_RESET, 0, which);
+    cmi8788_write_i2c (sc, sc->hw->front_dac, CS4398_MISC_CTRL,
+                       CS4398_CPEN | CS4398_POWER_DOWN);
+    cmi8788_write_i2c (sc, sc->hw->surr_dac, CS4362A_MODE1_CTRL,
+                       CS4362A_CPEN | CS4362A_POWER_DOWN);
+
+    for (i = 0; i < ARRAY_SIZE (cs4398_resume_regs); i++)
+        cs4398_write(sc, cs4398_resume_regs[i],
+                     sc->cs4398_regs[cs4398_resume_regs[i]]);
+    for (i = 0; i < ARRAY_SIZE (cs4362a_resume_regs); i++)
+        cs4362a_write(sc, cs4362a_resume_regs[i],
+                      sc->cs4362a_regs[cs4362a_resume_regs[i]]);
+    for (i = 0; i < ARRAY_SIZE (cs4362a_mix_regs); i++)
+        cs4362a_write(sc, cs4362a_mix_regs[i],
+                      sc->cs4362a_regs[cs4362a_mix_regs[i]]);
+    for (i = 0; i < ARRAY_SIZE (cs4362a_vol_regs); i++)
+        cs4362a_write(sc, cs4362a_vol_regs[i],
+                      sc->cs4362a_regs[cs4362a_vol_regs[i]]);
+
+    cs4398_write(sc, CS4398_MISC_CTRL, sc->cs4398_regs[CS4398_MISC_CTRL]);
+    cs4362a_write(sc, CS4362A_MODE1_CTRL, sc->cs4362a_regs[CS4362A_MODE1_CTRL]);
 }
 
-static int
-i2s_get_rate(int rate)
+static void
+cs43xx_set_power(struct xonar_info *sc, int on)
 {
-    int i2s_rate;
+    uint8_t val4398 = sc->cs4398_regs[CS4398_MISC_CTRL] & ~CS4398_POWER_DOWN;
+    uint8_t val4362a = sc->cs4362a_regs[CS4362A_MODE1_CTRL] & ~CS4362A_POWER_DOWN;
 
-    switch (rate) {
-    case 32000:
-        i2s_rate = I2S_FMT_RATE32;
-        break;
-    case 44100:
-        i2s_rate = I2S_FMT_RATE44;
-        break;
-    default:
-    case 48000:
-        i2s_rate = I2S_FMT_RATE48;
-        break;
-    case 64000:
-        i2s_rate = I2S_FMT_RATE64;
-        break;
-    case 88200:
-        i2s_rate = I2S_FMT_RATE88;
-        break;
-    case 96000:
-        i2s_rate = I2S_FMT_RATE96;
-        break;
-    case 176400:
-        i2s_rate = I2S_FMT_RATE176;
-        break;
-    case 192000:
-        i2s_rate = I2S_FMT_RATE192;
-        break;
+    if (!on) {
+        val4398 |= CS4398_POWER_DOWN;
+        val4362a |= CS4362A_POWER_DOWN;
     }
+    cs4398_update(sc, CS4398_MISC_CTRL, val4398);
+    cs4362a_update(sc, CS4362A_MODE1_CTRL, val4362a);
+}
 
-    return i2s_rate;
+static void
+cs43xx_set_volume(struct xonar_info *sc, int left, int right)
+{
+    int l, r, i, mute;
+
+    sc->vol[0] = left;
+    sc->vol[1] = right;
+
+    /* Both DACs take attenuation, CS4398 in 0.5dB steps, CS4362A in 1dB */
+    l = 255 - imin(xonar_vol_scale(sc, left, sc->pcm_vol[0]), 255);
+    r = 255 - imin(xonar_vol_scale(sc, right, sc->pcm_vol[1]), 255);
+
+    cs4398_update(sc, CS4398_VOLA, l);
+    cs4398_update(sc, CS4398_VOLB, r);
+
+    for (i = 0; i < ARRAY_SIZE (cs4362a_vol_regs); i++) {
+        mute = sc->cs4362a_regs[cs4362a_vol_regs[i]] & CS4362A_VOL_MUTE;
+        cs4362a_update(sc, cs4362a_vol_regs[i],
+                       mute | (((i < 3) ? l : r) >> 1));
+    }
 }
 
 static int
-i2s_get_bits(int fmt)
+cs43xx_get_mute(struct xonar_info *sc)
 {
-    int i2s_bits;
+    return (sc->cs4398_regs[CS4398_MUTE_CTRL] & CS4398_MUTE_A) ? 1: 0;
+}
 
-    switch (AFMT_BIT(fmt)) {
-    case 24:
-        i2s_bits = I2S_FMT_BITS24;
-        break;
-    case 32:
-        i2s_bits = I2S_FMT_BITS32;
-        break;
-    case 16:
-    default:
-        i2s_bits = I2S_FMT_BITS16;
-        break;
+static int
+cs43xx_set_mute(struct xonar_info *sc, int mute)
+{
+    uint8_t val;
+    int i;
+
+    val = sc->cs4398_regs[CS4398_MUTE_CTRL];
+    if (mute)
+        val |= CS4398_MUTE_A | CS4398_MUTE_B;
+    else
+        val &= ~(CS4398_MUTE_A | CS4398_MUTE_B);
+    cs4398_update(sc, CS4398_MUTE_CTRL, val);
+
+    for (i = 0; i < ARRAY_SIZE (cs4362a_vol_regs); i++) {
+        val = sc->cs4362a_regs[cs4362a_vol_regs[i]];
+        if (mute)
+            val |= CS4362A_VOL_MUTE;
+        else
+            val &= ~CS4362A_VOL_MUTE;
+        cs4362a_update(sc, cs4362a_vol_regs[i], val);
     }
+    return 0;
+}
 
-    return i2s_bits;
+static int
+cs43xx_get_rolloff(struct xonar_info *sc)
+{
+    return (sc->cs4398_regs[CS4398_RAMP_CTRL] & CS4398_FILT_SEL) ? 1: 0;
 }
 
-static const char*
-direction_as_string (int dir)
+static int
+cs43xx_set_rolloff(struct xonar_info *sc, int rolloff)
 {
-    switch (dir) {
-    case PCMDIR_PLAY:
-        return "Play";
-    case PCMDIR_REC:
-        return "Rec";
-    default:
-        return "Unknown";
+    uint8_t val4398 = sc->cs4398_regs[CS4398_RAMP_CTRL];
+    uint8_t val4362a = sc->cs4362a_regs[CS4362A_FILTER_CTRL];
+
+    if (rolloff) {
+        val4398 |= CS4398_FILT_SEL;
+        val4362a |= CS4362A_FILT_SEL;
+    } else {
+        val4398 &= ~CS4398_FILT_SEL;
+        val4362a &= ~CS4362A_FILT_SEL;
     }
+    cs4398_update(sc, CS4398_RAMP_CTRL, val4398);
+    cs4362a_update(sc, CS4362A_FILTER_CTRL, val4362a);
+    return 0;
 }
 
-static void *
-xonar_chan_init(kobj_t obj, void *devinfo,
-         struct snd_dbuf *b, struct pcm_channel *c, int dir)
+static void
+cs43xx_set_rate(struct xonar_info *sc, int speed)
 {
-    struct xonar_info *sc = devinfo;
-    struct xonar_chinfo *ch;
-    int n = (dir == PCMDIR_PLAY) ? 0 : MAX_PORTS_PLAY;
-    n += sc->pnum;
+    uint8_t fm4398, fm4362a;
+    int i;
 
-    ch = &sc->chan[n];
-    ch->buffer = b;
-    ch->parent = sc;
-    ch->channel = c;
-    ch->dir = dir;
-    ch->blksz = 2048;
-    switch (sc->pnum) {
-    case 0:
-    case 1:
-        device_printf(sc->dev, "channel %d (Multichannel) (%s)\n",
-                      sc->pnum, direction_as_string (dir));
-        ch->dac_type = 1;
-        switch (sc->model) {
-            case SUBID_XONAR_D1:
-            case SUBID_XONAR_DX:
-            case SUBID_XONAR_D2:
-            case SUBID_XONAR_D2X:
-            case SUBID_XONAR_STX:
-            case SUBID_XONAR_ST:
-                ch->adc_type = 2;
-                break;
-            case SUBID_XONAR_DS:
-                ch->adc_type = 1;
-                break;
-            default: 
-                ch->adc_type = 1;
-                cmi8788_setandclear_1 (sc, REC_ROUTING, 0x18, 0);
-                break;
-        }
-        break;
-    case 2:
-        /* if there is no front panel AC97, then skip the device */
-        break;
-    case 3:
-        device_printf(sc->dev, "channel %d (SPDIF) (%s)\n",
-                      sc->pnum, direction_as_string (dir));
-        break;
+    if (speed <= 50000) {
+        fm4398 = CS4398_FM_SINGLE;
+        fm4362a = CS4362A_FM_SINGLE;
+    } else if (speed <= 100000) {
+        fm4398 = CS4398_FM_DOUBLE;
+        fm4362a = CS4362A_FM_DOUBLE;
+    } else {
+        fm4398 = CS4398_FM_QUAD;
+        fm4362a = CS4362A_FM_QUAD;
     }
 
-    if (sndbuf_setup(ch->buffer, sc->buf[n], sc->bufsz) != 0) {
-        device_printf(sc->dev, "Cannot setup sndbuf\n");
-        return NULL;
-    }
+    cs4398_update(sc, CS4398_MODE_CTRL,
+                  (sc->cs4398_regs[CS4398_MODE_CTRL] & ~CS4398_FM_MASK) | fm4398);
+    for (i = 0; i < ARRAY_SIZE (cs4362a_mix_regs); i++)
+        cs4362a_update(sc, cs4362a_mix_regs[i],
+                       (sc->cs4362a_regs[cs4362a_mix_regs[i]] & ~CS4362A_FM_MASK) | fm4362a);
+}
 
-    ch->state = CHAN_STATE_INIT;
-    return ch;
+/* Cards we know nothing about */
+static void
+null_set_volume(struct xonar_info *sc, int left, int right)
+{
+    sc->vol[0] = left;
+    sc->vol[1] = right;
 }
 
-static struct pcmchan_caps *
-xonar_chan_getcaps(kobj_t obj, void *data)
+static int
+null_get(struct xonar_info *sc)
 {
-    /* XXX: proper caps */
-    return &xonar_caps;
+    return 0;
 }
 
-static u_int32_t
-xonar_chan_setspeed(kobj_t obj, void *data, u_int32_t speed)
+static int
+null_set(struct xonar_info *sc, int val)
 {
-#define GPIO_CS53x1_M_MASK  0x000c
-#define GPIO_CS53x1_M_SINGLE    0x0000
-#define GPIO_CS53x1_M_DOUBLE    0x0004
-#define GPIO_CS53x1_M_QUAD  0x0008
-    struct xonar_chinfo *ch = data;
-    struct xonar_info *sc = ch->parent;
-    int i2s_rate, i2s_rate_where, cs53x1_value;
+    return -1;
+}
 
-    XONAR_DEBUG("%s speed=%u\n", __func__, speed);
+static void
+null_set_rate(struct xonar_info *sc, int speed)
+{
+}
 
-    i2s_rate = i2s_get_rate(speed);
-    i2s_rate_where = 0;
-    switch (ch->dir) {
+static void
+null_resume(struct xonar_info *sc)
+{
+}
+
+static void
+null_set_power(struct xonar_info *sc, int on)
+{
+}
+
+static void
+cmi8788_set_input_route(struct xonar_info *sc, int mic)
+{
+    uint16_t gpio = sc->hw->input_route_gpio;
+
+    if (gpio == 0)
+        return;
+
+    if (mic)
+        cmi8788_setandclear_2 (sc, GPIO_DATA, gpio, 0);
+    else
+        cmi8788_setandclear_2 (sc, GPIO_DATA, 0, gpio);
+}
+
+/*
+ * Publish a state change through devctl, as
+ * "!system=SND subsystem=XONAR type=<type> cdev=dspN value=<value>".
+ */
+static void
+xonar_notify(struct xonar_info *sc, const char *type, int value)
+{
+    char data[32];
+
+    snprintf(data, sizeof(data), "cdev=dsp%d value=%d",
+             device_get_unit(sc->dev), value);
+    devctl_notify("SND", "XONAR", type, data);
+}
+
+static void
+cmi8788_toggle_sound(struct xonar_info *sc, int output) {
+    const struct xonar_model *hw = sc->hw;
+
+    if (output) {
+        cmi8788_setandclear_2 (sc, GPIO_CONTROL, hw->output_enable_gpio, 0);
+        tsleep (sc, 0, "apop", hw->anti_pop_delay);
+        cmi8788_setandclear_2 (sc, GPIO_DATA, hw->output_enable_gpio, 0);
+    } else {
+        cmi8788_setandclear_2 (sc, GPIO_DATA, 0, hw->output_enable_gpio);
+        tsleep (sc, 0, "apop", hw->anti_pop_delay);
+    }
+}
+
+/*
+ * Input monitoring mixes an ADC into the DAC pair selected by
+ * monitor_dest, in hardware and at 0dB or -6dB. Line and mic share the
+ * analog ADC, xonar_monitor_input() switches the capture input for them.
+ */
+static void
+cmi8788_update_monitor(struct xonar_info *sc)
+{
+    uint8_t bits = 0, half = 0, routing = MONITOR_ROUTING_DEFAULT;
+    int shift = 2 * sc->monitor_dest;
+
+    switch (sc->monitor_src) {
+    case MONITOR_SRC_LINE:
+    case MONITOR_SRC_MIC:
+        if (sc->hw->adc_type == 1) {
+            bits = REC_MONITOR_A;
+            half = REC_MONITOR_A_HALF;
+        } else {
+            bits = REC_MONITOR_B;
+            half = REC_MONITOR_B_HALF;
+        }
+        break;
+    case MONITOR_SRC_SPDIF:
+        bits = REC_MONITOR_C;
+        half = REC_MONITOR_C_HALF;
+        break;
+    }
+    if (sc->monitor_atten)
+        bits |= half;
+    if (!sc->monitor)
+        bits = 0;
+
+    /* The monitor mix comes out of pair 0, swap it with the destination */
+    routing &= ~(MONITOR_ROUTING_PAIR_MASK | (MONITOR_ROUTING_PAIR_MASK << shift));
+    routing |= sc->monitor_dest;
+
+    cmi8788_write_1 (sc, MONITOR_ROUTING, routing);
+    cmi8788_setandclear_1 (sc, REC_MONITOR, bits, REC_MONITOR_MASK);
+}
+
+/*
+ * While line or mic is monitored it has to be the recording source as
+ * well. That goes through the mixer so its recsrc stays in step, which
+ * takes the mixer lock: call without the softc lock.
+ */
+static void
+xonar_monitor_input(struct xonar_info *sc)
+{
+    if (!sc->monitor || sc->mixer == NULL)
+        return;
+    if (sc->monitor_src == MONITOR_SRC_LINE)
+        mix_setrecsrc(sc->mixer, SOUND_MASK_LINE);
+    else if (sc->monitor_src == MONITOR_SRC_MIC)
+        mix_setrecsrc(sc->mixer, SOUND_MASK_MIC);
+}
+
+static int
+cmi8788_set_output(struct xonar_info *sc, int which)
+{
+    const struct xonar_model *hw = sc->hw;
+
+    if (!(hw->outputs & (1 << which)))
+        return EINVAL;
+
+    cmi8788_toggle_sound(sc, 0);
+    if (hw->output_gpio_mask)
+        cmi8788_setandclear_2 (sc, GPIO_DATA, hw->output_gpio[which],
+                               hw->output_gpio_mask & ~hw->output_gpio[which]);
+    hw->set_volume (sc, sc->vol[0], sc->vol[1]);
+    /* An idle card gets its relay back on wake up */
+    if (!sc->idle)
+        cmi8788_toggle_sound(sc, 1);
+    xonar_status_output(sc, which);
+    xonar_notify(sc, "OUTPUT", which);
+    return 0;
+}
+
+static int
+cmi8788_get_output(struct xonar_info *sc)
+{
+    const struct xonar_model *hw = sc->hw;
+    uint16_t val;
+    int i;
+
+    val = cmi8788_read_2(sc, GPIO_DATA) & hw->output_gpio_mask;
+    for (i = 0; i < OUTPUT_NUM; i++) {
+        if ((hw->outputs & (1 << i)) && (val == hw->output_gpio[i]))
+            return i;
+    }
+
+    return OUTPUT_LINE;
+}
+
+static void 
+xonar_chan_reset(struct xonar_chinfo *ch, uint8_t which)
+{
+    struct xonar_info *sc = ch->parent;
+
+    cmi8788_setandclear_1 (sc, CHAN_RESET, which, 0);
+    DELAY(10);
+    cmi8788_setandclear_1 (sc, CHAN_RESET, 0, which);
+}
+
+/* Return the native rate closest to the given one, as I2S_FMT_RATE* */
+static int
+i2s_get_rate(int rate)
+{
+    int i, i2s_rate = I2S_FMT_RATE48;
+
+    for (i = 0; i < ARRAY_SIZE (xonar_rates); i++) {
+        if (abs (xonar_rates[i] - rate) < abs (xonar_rates[i2s_rate] - rate))
+            i2s_rate = i;
+    }
+
+    return i2s_rate;
+}
+
+static int
+i2s_get_bits(int fmt)
+{
+    int i2s_bits;
+
+    switch (AFMT_BIT(fmt)) {
+    case 24:
+        i2s_bits = I2S_FMT_BITS24;
+        break;
+    case 32:
+        i2s_bits = I2S_FMT_BITS32;
+        break;
+    case 16:
+    default:
+        i2s_bits = I2S_FMT_BITS16;
+        break;
+    }
+
+    return i2s_bits;
+}
+
+static const char*
+direction_as_string (int dir)
+{
+    switch (dir) {
     case PCMDIR_PLAY:
-        i2s_rate_where = I2S_MULTICH_FORMAT;
-        if (speed <= 88000)
-            pcm1796_write(sc, 20, PCM1796_OS_64);
+        return "Play";
+    case PCMDIR_REC:
+        return "Rec";
+    default:
+        return "Unknown";
+    }
+}
+
+static void *
+xonar_chan_init(kobj_t obj, void *devinfo,
+         struct snd_dbuf *b, struct pcm_channel *c, int dir)
+{
+    struct xonar_info *sc = devinfo;
+    struct xonar_chinfo *ch;
+    int n = (dir == PCMDIR_PLAY) ? 0 : MAX_PORTS_PLAY;
+    n += sc->pnum;
+
+    ch = &sc->chan[n];
+    ch->buffer = b;
+    ch->parent = sc;
+    ch->channel = c;
+    ch->dir = dir;
+    ch->blksz = 2048;
+    ch->frag = ch->blksz;
+    ch->phys_buf = sc->phys[n];
+    switch (sc->pnum) {
+    case 0:
+        device_printf(sc->dev, "channel %d (Multichannel) (%s)\n",
+                      sc->pnum, direction_as_string (dir));
+        if (dir == PCMDIR_PLAY)
+            ch->dac_type = 1;
+        else
+            ch->adc_type = sc->hw->adc_type;
+        break;
+    case 1:
+        device_printf(sc->dev, "channel %d (SPDIF) (%s)\n",
+                      sc->pnum, direction_as_string (dir));
+        if (dir == PCMDIR_PLAY)
+            ch->dac_type = 2;
+        else
+            ch->adc_type = 3;
+        break;
+    case 2:
+        /* Only registered if there is an AC97 codec to talk to */
+        device_printf(sc->dev, "channel %d (AC97) (%s)\n",
+                      sc->pnum, direction_as_string (dir));
+        if (dir == PCMDIR_PLAY)
+            ch->dac_type = 3;
         else
-            pcm1796_write(sc, 20, PCM1796_OS_32);
+            ch->adc_type = 4;
+        break;
+    }
+
+    if (sndbuf_setup(ch->buffer, sc->buf[n], sc->bufsz) != 0) {
+        device_printf(sc->dev, "Cannot setup sndbuf\n");
+        return NULL;
+    }
+
+    ch->state = CHAN_STATE_INIT;
+    return ch;
+}
+
+static struct pcmchan_caps *
+xonar_chan_getcaps(kobj_t obj, void *data)
+{
+    struct xonar_chinfo *ch = data;
+    struct xonar_info *sc = ch->parent;
+
+    if (ch->dac_type == 3 || ch->adc_type == 4)
+        return &xonar_caps_ac97;
+    if (ch->dir == PCMDIR_REC)
+        return (ch->adc_type == 3) ? &sc->spdif_in_caps : &xonar_caps;
+    return (ch->dac_type == 2) ? &xonar_caps_spdif : sc->hw->play_caps;
+}
+
+static int
+xonar_chan_getrates(kobj_t obj, void *data, int **rates)
+{
+    struct xonar_chinfo *ch = data;
+    struct xonar_info *sc = ch->parent;
+
+    /* A locked S/PDIF input can only be captured at its own rate */
+    if (ch->adc_type == 3 && sc->spdif_in_rate != 0) {
+        *rates = &sc->spdif_in_rate;
+        return 1;
+    }
+    if (ch->dac_type == 3 || ch->adc_type == 4) {
+        *rates = &xonar_rate_ac97;
+        return 1;
+    }
+    *rates = xonar_rates;
+    return ARRAY_SIZE (xonar_rates);
+}
+
+/*
+ * SPDIF_FUNC is not shadowed and its interrupt bits clear on writing 1,
+ * so they are kept out of read-modify-write updates.
+ */
+static void
+xonar_spdif_func(struct xonar_info *sc, uint32_t set, uint32_t clear)
+{
+    uint32_t func = cmi8788_read_4(sc, SPDIF_FUNC);
+
+    cmi8788_write_4(sc, SPDIF_FUNC,
+                    (func & ~(clear | SPDIF_INT_MASK)) | set);
+}
+
+/* Program S/PDIF output rate and channel status */
+static void
+xonar_spdif_setup(struct xonar_info *sc, int speed, u_int32_t fmt)
+{
+    int i2s_rate = i2s_get_rate(speed);
+    uint32_t status;
+
+    status = SPDIF_CS_COPY | SPDIF_CS_ORIGINAL | SPDIF_CS_CATEGORY_PCM |
+        (spdif_cs_rates[i2s_rate] << SPDIF_CS_RATE_SHIFT);
+    if (fmt & AFMT_AC3)
+        status |= SPDIF_CS_NONAUDIO;
+
+    if (cmi8788_read_4 (sc, SPDIFOUT_CHAN_STAT) == status &&
+        (cmi8788_read_4 (sc, SPDIF_FUNC) & SPDIF_OUT_RATE_MASK) ==
+        (i2s_rate << SPDIF_OUT_RATE_SHIFT))
+        return;
+
+    /* Receivers resync more reliably if the output drops while changing */
+    xonar_spdif_func (sc, 0, SPDIF_OUT_ENABLE);
+    cmi8788_write_4 (sc, SPDIFOUT_CHAN_STAT, status);
+    xonar_spdif_func (sc, SPDIF_OUT_ENABLE | (i2s_rate << SPDIF_OUT_RATE_SHIFT),
+                      SPDIF_OUT_RATE_MASK);
+}
+
+/*
+ * S/PDIF out is fed either by its own DMA engine or, in mirror mode, by
+ * the front pair of the multichannel engine, routed inside the CMI8788.
+ * A running S/PDIF channel takes precedence over the mirror.
+ */
+static void
+xonar_spdif_route(struct xonar_info *sc)
+{
+    struct xonar_chinfo *ch = &sc->chan[XONAR_CHAN_SPDIF];
+
+    if (sc->spdif_mirror && ch->state != CHAN_STATE_ACTIVE) {
+        ch = &sc->chan[XONAR_CHAN_MULTICH];
+        cmi8788_setandclear_2 (sc, PLAY_ROUTING, SPDIF_SRC_MULTICH_01, SPDIF_SRC_MASK);
+    } else
+        cmi8788_setandclear_2 (sc, PLAY_ROUTING, SPDIF_SRC_SPDIF, SPDIF_SRC_MASK);
+
+    if (ch->spd != 0)
+        xonar_spdif_setup(sc, ch->spd, ch->fmt);
+}
+
+/*
+ * Vasily:
+ * XXX: This is totally empirical. At least this works on ST.
+ * Without this sample rates > 48000 will produce total silence.
+ */
+static int
+xonar_mclk(int speed)
+{
+    if (speed <= 48000)
+        return XONAR_MCLOCK_512;
+    else if (speed <= 88000)
+        return XONAR_MCLOCK_256;
+    else
+        return XONAR_MCLOCK_128;
+}
+
+/*
+ * Bring an I2S interface, and for playback the DACs, to the channel's
+ * rate and sample size. The target format word is compared with the
+ * register and nothing is written if they match. Otherwise playback is
+ * soft-muted while the interface and the DACs are switched, so changing
+ * tracks between rates does not click. The softc lock is held through
+ * it, so the mute sysctl can't slip a mute in that the unmute would undo.
+ */
+static void
+xonar_i2s_update(struct xonar_chinfo *ch, int reg)
+{
+    struct xonar_info *sc = ch->parent;
+    uint16_t old, val, mask = I2S_BITS_MASK;
+    int unmute = 0;
+
+    val = i2s_get_bits(ch->fmt);
+    if (ch->spd != 0) {
+        val |= i2s_get_rate(ch->spd) | xonar_mclk(ch->spd);
+        mask |= I2S_FMT_RATE_MASK | XONAR_MCLOCK_MASK;
+    }
+    snd_mtxlock(sc->lock);
+    old = cmi8788_read_2(sc, reg);
+    if ((old & mask) == val) {
+        snd_mtxunlock(sc->lock);
+        return;
+    }
+
+    if (ch->dir == PCMDIR_PLAY && sc->hw->get_mute(sc) == 0 &&
+        sc->hw->set_mute(sc, 1) == 0) {
+        unmute = 1;
+        /*
+         * Give the soft mute time to ramp down at the old rate. The
+         * sound system holds the channel lock across this method, so
+         * it is waited out in place.
+         */
+        DELAY(XONAR_SOFTMUTE_FRAMES * 1000000 /
+              xonar_rates[old & I2S_FMT_RATE_MASK]);
+    }
+
+    cmi8788_write_2(sc, reg, (old & ~mask) | val);
+    if (ch->dir == PCMDIR_PLAY && ch->spd != 0)
+        sc->hw->set_rate(sc, ch->spd);
+
+    if (unmute)
+        sc->hw->set_mute(sc, 0);
+    snd_mtxunlock(sc->lock);
+    if (ch->dac_type == 1 && ch->spd != 0 && ((old ^ val) & I2S_FMT_RATE_MASK))
+        xonar_notify(sc, "RATE", ch->spd);
+}
+
+static u_int32_t
+xonar_chan_setspeed(kobj_t obj, void *data, u_int32_t speed)
+{
+    struct xonar_chinfo *ch = data, *rec;
+    struct xonar_info *sc = ch->parent;
+    int i2s_rate_where, cs53x1_value;
+
+    XONAR_DEBUG("%s speed=%u\n", __func__, speed);
+
+    /* Anything else is resampled by the sound system */
+    speed = xonar_rates[i2s_get_rate(speed)];
+    i2s_rate_where = 0;
+    switch (ch->dir) {
+    case PCMDIR_PLAY:
+        if (ch->dac_type == 2) {
+            ch->spd = speed;
+            xonar_spdif_route(sc);
+            break;
+        }
+        if (ch->dac_type == 3) {
+            ch->spd = xonar_rate_ac97;
+            break;
+        }
+        /*
+         * A running loopback capture is clocked by this engine and can't
+         * follow a rate change, playback is resampled to its rate instead.
+         */
+        rec = &sc->chan[MAX_PORTS_PLAY];
+        if (sc->rec_loopback && rec->adc_type == 2 &&
+            rec->state == CHAN_STATE_ACTIVE && rec->spd != 0)
+            speed = rec->spd;
+        i2s_rate_where = I2S_MULTICH_FORMAT;
         break;
     case PCMDIR_REC:
         switch (ch->adc_type) {
@@ -469,31 +1157,39 @@ xonar_chan_setspeed(kobj_t obj, void *data, u_int32_t speed)
             i2s_rate_where = I2S_ADC1_FORMAT;
             break;
         case 2:
+            /* Loopback is clocked by the multichannel engine */
+            if (sc->rec_loopback && sc->chan[XONAR_CHAN_MULTICH].spd != 0) {
+                ch->spd = sc->chan[XONAR_CHAN_MULTICH].spd;
+                return ch->spd;
+            }
             i2s_rate_where = I2S_ADC2_FORMAT;
             break;
+        case 3:
+            /* The receiver is clocked by the source, not by us */
+            if (sc->spdif_in_rate != 0)
+                speed = sc->spdif_in_rate;
+            ch->spd = speed;
+            xonar_spdif_func(sc, (speed > 96000) ?
+                             SPDIF_IN_CLOCK_192 : SPDIF_IN_CLOCK_96,
+                             SPDIF_IN_CLOCK_MASK);
+            return ch->spd;
+        case 4:
+            ch->spd = xonar_rate_ac97;
+            return ch->spd;
         }
 
         if (speed <= 54000) cs53x1_value = GPIO_CS53x1_M_SINGLE;
         else if (speed <= 108000) cs53x1_value = GPIO_CS53x1_M_DOUBLE;
         else cs53x1_value = GPIO_CS53x1_M_QUAD;
-        cmi8788_setandclear_2(sc, GPIO_DATA, cs53x1_value, GPIO_CS53x1_M_MASK);
+        cmi8788_update_2(sc, GPIO_DATA, cs53x1_value, GPIO_CS53x1_M_MASK);
         break;
     }
 
     if (i2s_rate_where) {
         ch->spd = speed;
-        /*
-         * Vasily:
-         * XXX: This is totally empirical. At least this works on ST.
-         * Without this sample rates > 48000 will produce total silence.
-         */
-        if (speed <= 48000)
-            cmi8788_setandclear_2(sc, i2s_rate_where, XONAR_MCLOCK_512, XONAR_MCLOCK_MASK);
-        else if (speed <= 88000)
-            cmi8788_setandclear_2(sc, i2s_rate_where, XONAR_MCLOCK_256, XONAR_MCLOCK_MASK);
-        else
-            cmi8788_setandclear_2(sc, i2s_rate_where, XONAR_MCLOCK_128, XONAR_MCLOCK_MASK);
-        cmi8788_setandclear_1 (sc, i2s_rate_where, i2s_rate, I2S_FMT_RATE_MASK);
+        xonar_i2s_update(ch, i2s_rate_where);
+        if (ch->dac_type == 1 && sc->spdif_mirror)
+            xonar_spdif_route(sc);
     }
     return ch->spd;
 }
@@ -503,8 +1199,8 @@ xonar_chan_setformat(kobj_t obj, void *data, u_int32_t format)
 {
     struct xonar_chinfo *ch = data;
     struct xonar_info *sc = ch->parent;
-    int bits, bits_where;
-    int i2s_bits, i2s_bits_where;
+    int bits, bits_where, bits_mask = MULTICH_FORMAT_MASK;
+    int i2s_bits_where = 0;
     int found = 0;
 
     XONAR_DEBUG("%s %d bits, %d chans\n", __func__, AFMT_BIT(format),
@@ -528,20 +1224,44 @@ xonar_chan_setformat(kobj_t obj, void *data, u_int32_t format)
     switch (ch->dir) {
     case PCMDIR_PLAY:
         bits_where = PLAY_FORMAT;
-        i2s_bits_where = I2S_MULTICH_FORMAT;
-        found = 1;
+        switch (ch->dac_type) {
+        case 1:
+            i2s_bits_where = I2S_MULTICH_FORMAT;
+            found = 1;
+            break;
+        case 2:
+            /* Same encoding as multichannel, two bits lower */
+            bits >>= 2;
+            bits_mask = SPDIF_FORMAT_MASK;
+            found = 1;
+            break;
+        case 3:
+            bits <<= 2;
+            bits_mask = FPOUT_FORMAT_MASK;
+            found = 1;
+            break;
+        }
         break;
     case PCMDIR_REC:
         bits_where = REC_FORMAT;
         switch (ch->adc_type) {
         case 1:
             i2s_bits_where = I2S_ADC1_FORMAT;
+            /* FALLTHROUGH */
+        case 4:
+            bits >>= 2;
+            bits_mask = RECA_FORMAT_MASK;
             found = 1;
             break;
         case 2:
             i2s_bits_where = I2S_ADC2_FORMAT;
             found = 1;
             break;
+        case 3:
+            bits <<= 2;
+            bits_mask = RECC_FORMAT_MASK;
+            found = 1;
+            break;
         }
         break;
     }
@@ -549,31 +1269,102 @@ xonar_chan_setformat(kobj_t obj, void *data, u_int32_t format)
     if (!found) return EINVAL;
 
     ch->fmt = format;
-    cmi8788_setandclear_1 (sc, bits_where, bits, MULTICH_FORMAT_MASK);
-    i2s_bits = i2s_get_bits (ch->fmt);
-    cmi8788_setandclear_1 (sc, i2s_bits_where, i2s_bits, I2S_BITS_MASK);
+    cmi8788_update_1 (sc, bits_where, bits, bits_mask);
+    if (i2s_bits_where)
+        xonar_i2s_update(ch, i2s_bits_where);
+    else if (ch->dac_type == 2)
+        xonar_spdif_route(sc);
 
     return 0;
 }
 
+/* Buffer registers of a DMA engine */
+struct xonar_dma_engine {
+    int bit;            /* CHANNEL_* */
+    int addr, size, frag;
+    int wide;           /* 32 bit counters, multichannel only */
+};
+
+static const struct xonar_dma_engine xonar_dma_reca =
+    { CHANNEL_RECA, RECA_ADDR, RECA_SIZE, RECA_FRAG, 0 };
+static const struct xonar_dma_engine xonar_dma_recb =
+    { CHANNEL_RECB, RECB_ADDR, RECB_SIZE, RECB_FRAG, 0 };
+static const struct xonar_dma_engine xonar_dma_recc =
+    { CHANNEL_RECC, RECC_ADDR, RECC_SIZE, RECC_FRAG, 0 };
+static const struct xonar_dma_engine xonar_dma_spdif =
+    { CHANNEL_SPDIF, SPDIF_ADDR, SPDIF_SIZE, SPDIF_FRAG, 0 };
+static const struct xonar_dma_engine xonar_dma_multich =
+    { CHANNEL_MULTICH, MULTICH_ADDR, MULTICH_SIZE, MULTICH_FRAG, 1 };
+static const struct xonar_dma_engine xonar_dma_fpout =
+    { CHANNEL_FPOUT, FPOUT_ADDR, FPOUT_SIZE, FPOUT_FRAG, 0 };
+
+/*
+ * Set up a DMA engine for the channel. The registers keep their values
+ * across stop and reset, so only those differing from what the channel
+ * programmed last time are written, and the engine is only reset when
+ * it has run since.
+ */
 static void
-xonar_prepare_input(struct xonar_chinfo *ch)
+xonar_dma_program(struct xonar_chinfo *ch, const struct xonar_dma_engine *e)
 {
     struct xonar_info *sc = ch->parent;
-    uint32_t addr = sc->phys[1];
+    uint32_t size = sc->bufsz / 4 - 1;
+    uint32_t frag = ch->frag / 4 - 1;
 
-    switch (ch->adc_type) {
-    case 2:
-        ch->dma_start = 0x2;
-        ch->irq_mask = 0x2;
-        xonar_chan_reset(ch, 0x2);
+    ch->dma_start = e->bit;
+    ch->irq_mask = e->bit;
 
-        XONAR_DEBUG("buffer addr = 0x%x size = %d\n",
-                    addr, sndbuf_getsize(ch->buffer));
+    if (!ch->dma_valid || ch->dma_ran) {
+        xonar_chan_reset(ch, e->bit);
+        ch->dma_ran = 0;
+    }
+
+    XONAR_DEBUG("buffer addr = 0x%x size = %d frag = %d\n",
+                ch->phys_buf, sndbuf_getsize(ch->buffer), ch->frag);
+
+    if (!ch->dma_valid || ch->dma_addr != ch->phys_buf)
+        cmi8788_write_4(sc, e->addr, ch->phys_buf);
+    if (!ch->dma_valid || ch->dma_size != size) {
+        if (e->wide)
+            cmi8788_write_4(sc, e->size, size);
+        else
+            cmi8788_write_2(sc, e->size, size);
+    }
+    if (!ch->dma_valid || ch->dma_frag != frag) {
+        if (e->wide)
+            cmi8788_write_4(sc, e->frag, frag);
+        else
+            cmi8788_write_2(sc, e->frag, frag);
+    }
+    ch->dma_addr = ch->phys_buf;
+    ch->dma_size = size;
+    ch->dma_frag = frag;
+    ch->dma_valid = 1;
+}
 
-        cmi8788_write_4(sc, RECB_ADDR, addr);
-        cmi8788_write_2(sc, RECB_SIZE, sc->bufsz / 4 - 1);
-        cmi8788_write_2(sc, RECB_FRAG, 1024 / 4 /* XXX */ - 1);
+static void
+xonar_prepare_input(struct xonar_chinfo *ch)
+{
+    struct xonar_info *sc = ch->parent;
+    int route;
+
+    switch (ch->adc_type) {
+    case 1:
+    case 4:
+        if (ch->adc_type == 1)
+            route = RECA_ROUTE_I2S_ADC1;
+        else if (sc->ac97_codecs & AC97_CODEC0)
+            route = RECA_ROUTE_AC97_0;
+        else
+            route = RECA_ROUTE_AC97_1;
+        cmi8788_setandclear_1(sc, REC_ROUTING, route, RECA_ROUTE_MASK);
+        xonar_dma_program(ch, &xonar_dma_reca);
+        break;
+    case 2:
+        xonar_dma_program(ch, &xonar_dma_recb);
+        break;
+    case 3:
+        xonar_dma_program(ch, &xonar_dma_recc);
         break;
     default:
         break;
@@ -584,15 +1375,10 @@ static void
 xonar_prepare_output(struct xonar_chinfo *ch)
 {
     struct xonar_info *sc = ch->parent;
-    uint32_t addr = sc->phys[0];
+    int channels;
 
     switch (ch->dac_type) {
     case 1:
-        ch->dma_start = CHANNEL_MULTICH;
-        ch->irq_mask = CHANNEL_MULTICH;
-        xonar_chan_reset(ch, CHANNEL_MULTICH);
-
-        int channels;
         switch (AFMT_CHANNEL(ch->fmt)) {
         default:
         case 2:
@@ -609,25 +1395,335 @@ xonar_prepare_output(struct xonar_chinfo *ch)
             break;
         }
 
-        XONAR_DEBUG("buffer addr = 0x%x size = %d\n",
-                    addr, sndbuf_getsize(ch->buffer));
-
-        cmi8788_write_4(sc, MULTICH_ADDR, addr);
-        cmi8788_write_4(sc, MULTICH_SIZE, sc->bufsz / 4 - 1);
-        /* what is this 1024 you ask
-         * i have no idea
-         * oss uses dmap->fragment_size
-         * alsa uses params_period_bytes()
-         */
-        cmi8788_write_4(sc, MULTICH_FRAG, 1024 / 4 /* XXX */ - 1);
-
+        xonar_dma_program(ch, &xonar_dma_multich);
         cmi8788_setandclear_1 (sc, MULTICH_MODE, channels, MULTICH_MODE_CH_MASK);
         break;
+    case 2:
+        xonar_dma_program(ch, &xonar_dma_spdif);
+        break;
+    case 3:
+        xonar_dma_program(ch, &xonar_dma_fpout);
+        break;
     default:
         break;
     }
 }
 
+/*
+ * SNDCTL_DSP_SYNCSTART locks all members of the group, then takes them
+ * off it one after another: it clears the member's sm, starts it and
+ * only then clears CHN_F_NOTRIGGER. So the channel being triggered is in
+ * a syncstart when it has CHN_F_NOTRIGGER but no sm, and the members
+ * still waiting are the ones that have both and whose lock this thread
+ * holds. While one of our channels is waiting the DMA start is held
+ * back and issued with the last one, in a single DMA_START write. Groups
+ * only set up by SNDCTL_DSP_SYNCGROUP are not locked by us and never
+ * hold anything back.
+ */
+static int
+xonar_sync_pending(struct xonar_chinfo *ch)
+{
+    struct xonar_info *sc = ch->parent;
+    struct pcm_channel *c, *own = ch->channel;
+    int i;
+
+    if (own == NULL || own->sm != NULL || !(own->flags & CHN_F_NOTRIGGER))
+        return 0;
+    for (i = 0; i < MAX_PORTS_PLAY+MAX_PORTS_REC; i++) {
+        c = sc->chan[i].channel;
+        if (&sc->chan[i] == ch || c == NULL)
+            continue;
+        if (c->sm != NULL && (c->flags & CHN_F_NOTRIGGER) &&
+            CHN_LOCKOWNED(c))
+            return 1;
+    }
+    return 0;
+}
+
+/* Fires at start_at with the softc lock held, see sysctl start_at */
+static void
+xonar_start_callout(void *arg)
+{
+    struct xonar_info *sc = arg;
+
+    cmi8788_setandclear_2 (sc, DMA_START, sc->sync_start, 0);
+    sc->start_error = sbttons(sbinuptime() - sc->start_at);
+    sc->sync_start = 0;
+    sc->start_at = 0;
+}
+
+/*
+ * Idle power down: once no channel has run for idle_timeout seconds,
+ * open the output relay and then power the DACs down, in the order
+ * cmi8788_toggle_sound() uses to avoid pops. Input monitoring plays
+ * through the DACs without a channel, so it keeps the card awake.
+ */
+static void
+xonar_idle_task(void *arg, int pending)
+{
+    struct xonar_info *sc = arg;
+    int i;
+
+    snd_mtxlock(sc->lock);
+    for (i = 0; i < MAX_PORTS_PLAY + MAX_PORTS_REC; i++)
+        if (sc->chan[i].state == CHAN_STATE_ACTIVE)
+            break;
+    if (i == MAX_PORTS_PLAY + MAX_PORTS_REC && sc->idle_timeout &&
+        !sc->idle && !sc->monitor) {
+        XONAR_DEBUG("idle, powering down\n");
+        cmi8788_setandclear_2 (sc, GPIO_DATA, 0, sc->hw->output_enable_gpio);
+        sc->hw->set_power(sc, 0);
+        sc->idle = 1;
+    }
+    snd_mtxunlock(sc->lock);
+}
+
+/* Close the output relay once the DACs have settled */
+static void
+xonar_relay_task(void *arg, int pending)
+{
+    struct xonar_info *sc = arg;
+
+    snd_mtxlock(sc->lock);
+    if (!sc->idle)
+        cmi8788_setandclear_2 (sc, GPIO_DATA, sc->hw->output_enable_gpio, 0);
+    snd_mtxunlock(sc->lock);
+}
+
+/* Called with the softc lock held whenever a channel stops */
+static void
+xonar_idle_arm(struct xonar_info *sc)
+{
+    int i;
+
+    if (sc->idle_timeout == 0 || sc->idle || sc->monitor)
+        return;
+    for (i = 0; i < MAX_PORTS_PLAY + MAX_PORTS_REC; i++)
+        if (sc->chan[i].state == CHAN_STATE_ACTIVE)
+            return;
+    taskqueue_enqueue_timeout(taskqueue_thread, &sc->idle_task,
+                              sc->idle_timeout * hz);
+}
+
+/*
+ * Power the DACs up from trigger, with the softc lock held. Only the
+ * codec writes happen here, so DMA starts on time; the relay is closed
+ * later from a task, after the same anti-pop delay as on attach.
+ */
+static void
+xonar_wake(struct xonar_info *sc)
+{
+    sbintime_t t0 = sbinuptime();
+
+    taskqueue_cancel_timeout(taskqueue_thread, &sc->idle_task, NULL);
+    if (!sc->idle)
+        return;
+    sc->hw->set_power(sc, 1);
+    sc->idle = 0;
+    taskqueue_enqueue_timeout(taskqueue_thread, &sc->relay_task,
+                              sc->hw->anti_pop_delay);
+    sc->wakeups++;
+    sc->wake_cost = sbttons(sbinuptime() - t0);
+}
+
+/*
+ * DoP carries DSD in 24-bit PCM frames at 176.4kHz, for a DAC behind
+ * S/PDIF to unpack. The PCM1796s cannot take DSD from the CMI8788, and
+ * what they make of DoP is noise. So while the front pair carries it,
+ * through spdif_mirror, the DACs are muted. Two frames at offset in
+ * the buffer are checked: both channels must have the same marker and
+ * the marker must alternate.
+ */
+static int
+xonar_dop_check(struct xonar_chinfo *ch, uint32_t offset)
+{
+    struct xonar_info *sc = ch->parent;
+    const uint8_t *buf = sc->buf[ch - sc->chan];
+    int bps, align, i, m[2];
+
+    switch (AFMT_ENCODING(ch->fmt)) {
+    case AFMT_S24_LE:
+        bps = 3;
+        break;
+    case AFMT_S32_LE:
+        bps = 4;
+        break;
+    default:
+        return 0;
+    }
+    align = AFMT_ALIGN(ch->fmt);
+    offset -= offset % align;
+    for (i = 0; i < 2; i++) {
+        if (offset + align > sc->bufsz)
+            offset = 0;
+        m[i] = buf[offset + bps - 1];
+        if (buf[offset + 2 * bps - 1] != m[i])
+            return 0;
+        offset += align;
+    }
+    return (m[0] == DOP_MARKER_A || m[0] == DOP_MARKER_B) && m[1] == (m[0] ^ 0xff);
+}
+
+/*
+ * Called with the softc lock held, for the multichannel channel. Only
+ * the state is recorded here, from the interrupt too; the codec writes
+ * and the notification are left to xonar_dop_task().
+ */
+static void
+xonar_dop_update(struct xonar_chinfo *ch, uint32_t offset, int running)
+{
+    struct xonar_info *sc = ch->parent;
+    int dop = running && sc->dop && xonar_dop_check(ch, offset);
+
+    if (dop == sc->dop_active)
+        return;
+    sc->dop_active = dop;
+    taskqueue_enqueue(taskqueue_thread, &sc->dop_task);
+}
+
+/* Mute or unmute the DACs to follow dop_active */
+static void
+xonar_dop_task(void *arg, int pending)
+{
+    struct xonar_info *sc = arg;
+    int dop;
+
+    snd_mtxlock(sc->lock);
+    dop = sc->dop_active;
+    if (dop && !sc->dop_muted && sc->hw->get_mute(sc) == 0 &&
+        sc->hw->set_mute(sc, 1) == 0)
+        sc->dop_muted = 1;
+    else if (!dop && sc->dop_muted) {
+        sc->hw->set_mute(sc, 0);
+        sc->dop_muted = 0;
+    }
+    snd_mtxunlock(sc->lock);
+    xonar_notify(sc, "DOP", dop);
+}
+
+/*
+ * Update the channel's entry in the status page, with the softc lock
+ * held. Readers retry while seq is odd, see xonar_status.h.
+ */
+static void
+xonar_status_chan(struct xonar_chinfo *ch, int running, int period)
+{
+    struct xonar_info *sc = ch->parent;
+    struct xonar_status *st = sc->status;
+    struct xonar_status_chan *sch = &st->chan[ch - sc->chan];
+    int reg = xonar_chan_ptr_reg(ch);
+
+    atomic_store_rel_32(&st->seq, st->seq + 1);
+    atomic_thread_fence_rel();
+    sch->running = running;
+    sch->rate = ch->spd;
+    sch->format = ch->fmt;
+    sch->pos = reg ? cmi8788_read_4(sc, reg) - ch->phys_buf : 0;
+    sch->bufsz = ch->buffer ? sndbuf_getsize(ch->buffer) : 0;
+    sch->period = ch->frag;
+    sch->time = sbttons(sbinuptime());
+    sch->periods += period;
+    sch->xruns = ch->channel ? ch->channel->xruns : 0;
+    atomic_store_rel_32(&st->seq, st->seq + 1);
+}
+
+static void
+xonar_status_output(struct xonar_info *sc, int which)
+{
+    struct xonar_status *st = sc->status;
+
+    snd_mtxlock(sc->lock);
+    atomic_store_rel_32(&st->seq, st->seq + 1);
+    atomic_thread_fence_rel();
+    st->output = which;
+    atomic_store_rel_32(&st->seq, st->seq + 1);
+    snd_mtxunlock(sc->lock);
+}
+
+static int
+xonar_status_open(struct cdev *dev, int oflags, int devtype, struct thread *td)
+{
+    return (oflags & FWRITE) ? EPERM : 0;
+}
+
+/*
+ * Mappings take a reference on the page's VM object, so the page stays
+ * with them after detach instead of going back to the allocator.
+ */
+static int
+xonar_status_mmap_single(struct cdev *dev, vm_ooffset_t *offset,
+                         vm_size_t size, struct vm_object **object, int nprot)
+{
+    struct xonar_info *sc = dev->si_drv1;
+
+    if (nprot & PROT_WRITE)
+        return EPERM;
+    if (*offset != 0 || size != PAGE_SIZE)
+        return EINVAL;
+    vm_object_reference(sc->status_obj);
+    *object = sc->status_obj;
+    return 0;
+}
+
+static struct cdevsw xonar_status_cdevsw = {
+    .d_version = D_VERSION,
+    .d_open = xonar_status_open,
+    .d_mmap_single = xonar_status_mmap_single,
+    .d_name = "xonarstat",
+};
+
+/* One zeroed, wired page in an OBJT_PHYS object, mapped into the kernel */
+static int
+xonar_status_alloc(struct xonar_info *sc)
+{
+    vm_page_t m;
+
+    sc->status_obj = vm_object_allocate(OBJT_PHYS, 1);
+    VM_OBJECT_WLOCK(sc->status_obj);
+    m = vm_page_grab(sc->status_obj, 0, VM_ALLOC_WIRED | VM_ALLOC_ZERO);
+    VM_OBJECT_WUNLOCK(sc->status_obj);
+    if ((m->flags & PG_ZERO) == 0)
+        pmap_zero_page(m);
+    vm_page_valid(m);
+    vm_page_xunbusy(m);
+    sc->status_page = m;
+
+    sc->status = (struct xonar_status *)kva_alloc(PAGE_SIZE);
+    if (sc->status == NULL)
+        return ENOMEM;
+    pmap_qenter((vm_offset_t)sc->status, &m, 1);
+    return 0;
+}
+
+/* Existing mappings keep the object, and with it the page, alive */
+static void
+xonar_status_free(struct xonar_info *sc)
+{
+    if (sc->status != NULL) {
+        pmap_qremove((vm_offset_t)sc->status, 1);
+        kva_free((vm_offset_t)sc->status, PAGE_SIZE);
+        sc->status = NULL;
+    }
+    if (sc->status_obj != NULL) {
+        vm_page_unwire(sc->status_page, PQ_ACTIVE);
+        vm_object_deallocate(sc->status_obj);
+        sc->status_obj = NULL;
+        sc->status_page = NULL;
+    }
+}
+
+CTASSERT(sizeof(struct xonar_status) <= PAGE_SIZE);
+CTASSERT(XONAR_STATUS_CHANS == MAX_PORTS_PLAY + MAX_PORTS_REC);
+
+/* Make the CPU's and the engine's view of the channel's buffer agree */
+static void
+xonar_dma_sync(struct xonar_chinfo *ch, int op)
+{
+    struct xonar_info *sc = ch->parent;
+
+    bus_dmamap_sync(sc->dmat, sc->dma_map[ch - sc->chan], op);
+}
+
 static int
 xonar_chan_trigger(kobj_t obj, void *data, int go) 
 {
@@ -635,6 +1731,7 @@ xonar_chan_trigger(kobj_t obj, void *data, int go)
     struct xonar_info *sc = ch->parent;
     void (*prepare_func) (struct xonar_chinfo*) =
         (ch->dir == PCMDIR_PLAY) ? xonar_prepare_output : xonar_prepare_input;
+    sbintime_t t0 = sbinuptime();
 
     if (!PCMTRIG_COMMON(go))
         return 0;
@@ -649,13 +1746,35 @@ xonar_chan_trigger(kobj_t obj, void *data, int go)
                     sc->bufsz, ch->state);
         if (ch->state == CHAN_STATE_ACTIVE)
             break;
-        if (ch->state == CHAN_STATE_INIT)
+        xonar_wake(sc);
+        /* After resume the engine registers are back at their defaults */
+        if (ch->state == CHAN_STATE_INIT || !ch->dma_valid)
             prepare_func (ch);
         ch->state = CHAN_STATE_ACTIVE;
+        ch->dma_ran = 1;
+        xonar_dma_sync(ch, (ch->dir == PCMDIR_PLAY) ?
+                       BUS_DMASYNC_PREWRITE : BUS_DMASYNC_PREREAD);
         /* enable irq */
         cmi8788_setandclear_2 (sc, IRQ_MASK, ch->irq_mask, 0);
-        /* enable dma */
-        cmi8788_setandclear_2 (sc, DMA_START, ch->dma_start, 0);
+        /* enable dma, together with the rest of the sync group */
+        sc->sync_start |= ch->dma_start;
+        if (sc->start_at != 0) {
+            /* Everything is set up, only the DMA_START write is left */
+            if (!callout_pending(&sc->start_callout))
+                callout_reset_sbt(&sc->start_callout, sc->start_at, 0,
+                                  xonar_start_callout, sc, C_ABSOLUTE);
+        } else if (!xonar_sync_pending(ch)) {
+            cmi8788_setandclear_2 (sc, DMA_START, sc->sync_start, 0);
+            sc->sync_start = 0;
+            sc->start_latency = sbttons(sbinuptime() - t0);
+        }
+        if (ch->dac_type == 1) {
+            taskqueue_enqueue_timeout(taskqueue_thread, &sc->rate_task, 1);
+            xonar_dop_update(ch, 0, 1);
+        }
+        if (ch->dac_type == 2 && sc->spdif_mirror)
+            xonar_spdif_route(sc);
+        xonar_status_chan(ch, 1, 0);
         break;
 
     case PCMTRIG_ABORT:
@@ -664,10 +1783,19 @@ xonar_chan_trigger(kobj_t obj, void *data, int go)
         if (!(ch->state == CHAN_STATE_ACTIVE))
             break;
         ch->state = CHAN_STATE_INACTIVE;
+        sc->sync_start &= ~ch->dma_start;
         /* disable dma */
         cmi8788_setandclear_2 (sc, DMA_START, 0, ch->dma_start);
         /* disable irq */
         cmi8788_setandclear_2 (sc, IRQ_MASK, 0, ch->irq_mask);
+        xonar_dma_sync(ch, (ch->dir == PCMDIR_PLAY) ?
+                       BUS_DMASYNC_POSTWRITE : BUS_DMASYNC_POSTREAD);
+        if (ch->dac_type == 2 && sc->spdif_mirror)
+            xonar_spdif_route(sc);
+        if (ch->dac_type == 1)
+            xonar_dop_update(ch, 0, 0);
+        xonar_status_chan(ch, 0, 0);
+        xonar_idle_arm(sc);
         break;
     default:
         break;
@@ -682,17 +1810,18 @@ xonar_chan_setblocksize(kobj_t obj, void *data, u_int32_t blocksize)
     struct xonar_chinfo *ch = data;
 
     if (ch->blksz != blocksize) {
+        /* One interrupt per block, only FRAG needs rewriting */
         ch->blksz = blocksize;
+        ch->frag = blocksize;
         ch->state = CHAN_STATE_INIT;
     }
     return blocksize;
 }
 
-static u_int32_t
-xonar_chan_getptr(kobj_t obj, void *data)
+/* The register the channel's DMA engine keeps its position in */
+static int
+xonar_chan_ptr_reg(struct xonar_chinfo *ch)
 {
-    struct xonar_chinfo *ch = data;
-    struct xonar_info *sc = ch->parent;
     int reg = 0;
 
     switch (ch->dir) {
@@ -701,18 +1830,146 @@ xonar_chan_getptr(kobj_t obj, void *data)
         case 1:
             reg = MULTICH_ADDR;
             break;
+        case 2:
+            reg = SPDIF_ADDR;
+            break;
+        case 3:
+            reg = FPOUT_ADDR;
+            break;
         }
         break;
     case PCMDIR_REC:
         switch (ch->adc_type) {
+        case 1:
+        case 4:
+            reg = RECA_ADDR;
+            break;
         case 2:
             reg = RECB_ADDR;
             break;
+        case 3:
+            reg = RECC_ADDR;
+            break;
         }
         break;
     }
-    if (reg) return cmi8788_read_4(sc, reg);
-    else return 0;
+    return reg;
+}
+
+static u_int32_t
+xonar_chan_getptr(kobj_t obj, void *data)
+{
+    struct xonar_chinfo *ch = data;
+    struct xonar_info *sc = ch->parent;
+    int reg = xonar_chan_ptr_reg(ch);
+
+    if (reg == 0)
+        return 0;
+
+    /*
+     * The sound system reads captured data right after asking where the
+     * engine is: drop stale lines first. Played data is flushed once it
+     * has been written, after chn_intr() in xonar_intr().
+     */
+    if (ch->dir == PCMDIR_REC)
+        xonar_dma_sync(ch, BUS_DMASYNC_POSTREAD | BUS_DMASYNC_PREREAD);
+    return cmi8788_read_4(sc, reg);
+}
+
+/*
+ * Move the running vchan parent to a new rate the way the vchanrate
+ * sysctl does: a started channel can't change its parameters, so stop
+ * it, reset it, let the busy vchans rebuild their feeders and start it
+ * again. Called with the parent's lock held and the device acquired.
+ */
+static void
+xonar_rate_switch(struct pcm_channel *c, uint32_t speed)
+{
+    struct pcm_channel *child;
+    int restart;
+
+    restart = CHN_STARTED(c);
+    if (restart)
+        chn_abort(c);
+    if (chn_reset(c, c->format, speed) == 0)
+        c->parentsnddev->pvchanrate = c->speed;
+    if (restart) {
+        CHN_FOREACH(child, c, children.busy) {
+            CHN_LOCK(child);
+            if (VCHAN_SYNC_REQUIRED(child))
+                vchan_sync(child);
+            CHN_UNLOCK(child);
+        }
+        c->flags |= CHN_F_DIRTY;
+        chn_start(c, 1);
+    }
+}
+
+/*
+ * Sort the streams feeding the playback channel into those running at
+ * the hardware rate and those the sound system has to resample. If more
+ * than half of the vchans share another native rate, move the hardware
+ * there, the vchan mixer follows its parent's rate. A mere plurality is
+ * not enough, it would switch back and forth as streams come and go.
+ */
+static void
+xonar_rate_task(void *arg, int pending)
+{
+    struct xonar_chinfo *ch = arg;
+    struct xonar_info *sc = ch->parent;
+    struct pcm_channel *c = ch->channel, *child;
+    struct snddev_info *d = c->parentsnddev;
+    int count[ARRAY_SIZE (xonar_rates)];
+    int i, best, native = 0, resampled = 0, vchans, active;
+
+    memset(count, 0, sizeof(count));
+
+    PCM_LOCK(d);
+    PCM_WAIT(d);
+    PCM_ACQUIRE(d);
+    PCM_UNLOCK(d);
+
+    CHN_LOCK(c);
+    best = i2s_get_rate(ch->spd);
+    vchans = (c->flags & CHN_F_HAS_VCHAN) != 0;
+    if (vchans) {
+        CHN_FOREACH(child, c, children.busy) {
+            CHN_LOCK(child);
+            i = i2s_get_rate(child->speed);
+            if (child->speed == xonar_rates[i])
+                count[i]++;
+            if (child->speed == ch->spd)
+                native++;
+            else
+                resampled++;
+            CHN_UNLOCK(child);
+        }
+    } else if (c->speed == ch->spd)
+        native++;
+    else
+        resampled++;
+
+    for (i = 0; i < ARRAY_SIZE (xonar_rates); i++) {
+        if (count[i] > count[best])
+            best = i;
+    }
+    if (vchans && sc->rate_follow && xonar_rates[best] != ch->spd &&
+        2 * count[best] > native + resampled) {
+        XONAR_DEBUG("following the majority stream rate %d\n", xonar_rates[best]);
+        xonar_rate_switch(c, xonar_rates[best]);
+    }
+    active = ch->state == CHAN_STATE_ACTIVE;
+    CHN_UNLOCK(c);
+
+    PCM_RELEASE_QUICK(d);
+
+    snd_mtxlock(sc->lock);
+    sc->streams_native = native;
+    sc->streams_resampled = resampled;
+    snd_mtxunlock(sc->lock);
+
+    if (active)
+        taskqueue_enqueue_timeout(taskqueue_thread, &sc->rate_task, hz);
 }
 
 static kobj_method_t xonar_chan_methods[] = {
@@ -721,6 +1978,7 @@ static kobj_method_t xonar_chan_methods[] = {
     KOBJMETHOD(channel_setformat,       xonar_chan_setformat),
     KOBJMETHOD(channel_trigger,     xonar_chan_trigger),
     KOBJMETHOD(channel_setspeed,        xonar_chan_setspeed),
+    KOBJMETHOD(channel_getrates,        xonar_chan_getrates),
     KOBJMETHOD(channel_getptr,      xonar_chan_getptr),
     KOBJMETHOD(channel_setblocksize,    xonar_chan_setblocksize),
     KOBJMETHOD_END
@@ -777,6 +2035,8 @@ xonar_mixer_init(struct snd_mixer *m)
     uint32_t devs = 0;
     uint32_t rec_devs = 0;
 
+    sc->mixer = m;
+
     /* Create AC97 submixer */
     if (sc->ac97_codec != NULL) {
         sc->ac97_mixer = mixer_create (sc->dev, ac97_getmixerclass(), sc->ac97_codec, "ac97");
@@ -793,6 +2053,9 @@ xonar_mixer_init(struct snd_mixer *m)
     */
     devs |= SOUND_MASK_VOLUME;
 
+    /* PCM volume is done by the DAC too, not by the volume feeder */
+    devs |= SOUND_MASK_PCM;
+
     /*
       FIXME: At least in Xonar ST(X) you cannot amplify line input
       but you can still choose it as audio input
@@ -800,6 +2063,10 @@ xonar_mixer_init(struct snd_mixer *m)
     devs |= SOUND_MASK_LINE;
     rec_devs |= SOUND_MASK_LINE;
 
+    /* Digital loopback of the multichannel front pair, RECB only */
+    if (sc->hw->adc_type == 2)
+        rec_devs |= SOUND_MASK_MONITOR;
+
     mix_setdevs(m, devs);
     mix_setrecdevs (m, rec_devs);
 
@@ -818,6 +2085,7 @@ xonar_mixer_uninit (struct snd_mixer *m)
         sc->ac97_mixer = NULL;
         sc->ac97_codec = NULL; /* It also frees the codec */
     }
+    sc->mixer = NULL;
     return 0;
 }
 
@@ -828,7 +2096,11 @@ xonar_mixer_set(struct snd_mixer *m, unsigned dev, unsigned left, unsigned right
 
     snd_mtxlock(sc->lock);
     if (dev == SOUND_MIXER_VOLUME) {
-        pcm1796_set_volume(sc, left, right);
+        sc->hw->set_volume(sc, left, right);
+    } else if (dev == SOUND_MIXER_PCM) {
+        sc->pcm_vol[0] = left;
+        sc->pcm_vol[1] = right;
+        sc->hw->set_volume(sc, sc->vol[0], sc->vol[1]);
     } else if (sc->ac97_mixer != NULL) {
         mix_set (sc->ac97_mixer, dev, left, right);
     }
@@ -848,14 +2120,31 @@ xonar_mixer_setrecsrc(struct snd_mixer *m, uint32_t src)
     }
 
     snd_mtxlock (sc->lock);
+    /*
+     * Loopback replaces the ADC on the RECB engine: what is played on
+     * the front pair is captured without going through the codecs. It
+     * is always the front pair, MONITOR_ROUTING only places the input
+     * monitor mix and monitor_dest does not change what is looped back.
+     */
+    if (src & SOUND_MASK_MONITOR) {
+        cmi8788_setandclear_1 (sc, REC_ROUTING, RECB_ROUTE_LOOPBACK, RECB_ROUTE_MASK);
+        sc->rec_loopback = 1;
+        snd_mtxunlock (sc->lock);
+        return SOUND_MASK_MONITOR;
+    }
+    if (sc->rec_loopback) {
+        cmi8788_setandclear_1 (sc, REC_ROUTING, RECB_ROUTE_I2S_ADC2, RECB_ROUTE_MASK);
+        sc->rec_loopback = 0;
+    }
+
     if (src & SOUND_MASK_LINE) {
-        cmi8788_setandclear_2 (sc, GPIO_DATA, 0, GPIO_PIN8);
+        cmi8788_set_input_route (sc, 0);
         xonar_ac97_write (sc, 0, 0x72, xonar_ac97_read (sc, 0, 0x72) & ~0x1);
         recmask = SOUND_MASK_LINE;
     }
     else if ((src & SOUND_MASK_MIC) && (sc->ac97_mixer != NULL) &&
              (mix_setrecsrc (sc->ac97_mixer, src) == 0)) {
-        cmi8788_setandclear_2 (sc, GPIO_DATA, GPIO_PIN8, 0);
+        cmi8788_set_input_route (sc, 1);
         xonar_ac97_write (sc, 0, 0x72, xonar_ac97_read (sc, 0, 0x72) | 0x1);
         recmask = SOUND_MASK_MIC;
     }
@@ -873,129 +2162,387 @@ static kobj_method_t xonar_mixer_methods[] = {
 };
 MIXER_DECLARE(xonar_mixer);
 
-static int
-xonar_init(struct xonar_info *sc)
+/* Model specific initialization */
+static void
+xonar_stx_init(struct xonar_info *sc)
 {
-    uint16_t sVal;
-    uint16_t sDac;
-    uint8_t bVal;
-    int count;
-
-    /* Init CMI controller */
-    sVal = cmi8788_read_2(sc, CTRL_VERSION);
-    if (!(sVal & CTRL_VERSION2)) {
-        bVal = cmi8788_read_1(sc, MISC_REG);
-        bVal |= MISC_PCI_MEM_W_1_CLOCK;
-        cmi8788_write_1(sc, MISC_REG, bVal);
-    }
-    bVal = cmi8788_read_1(sc, FUNCTION);
-    bVal |= FUNCTION_RESET_CODEC;
-    cmi8788_write_1(sc, FUNCTION, bVal);
+    sc->pcm1796_dacs = 1;
 
-    /* set up DAC related settings */
-    sDac = I2S_MASTER | I2S_FMT_RATE48 | I2S_FMT_LJUST | I2S_FMT_BITS16;
+    cmi8788_setandclear_1 (sc, FUNCTION, FUNCTION_2WIRE, 0);
+    cmi8788_setandclear_2 (sc, GPIO_CONTROL, 0x018F, 0);
+    cmi8788_setandclear_2(sc, GPIO_DATA, GPIO_PIN0 | GPIO_PIN4 | GPIO_PIN8, 0);
+    cmi8788_setandclear_2(sc, I2C_CTRL, TWOWIRE_SPEED_FAST, 0);
 
-    switch (sc->model) {
-    case SUBID_XONAR_D1:
-    case SUBID_XONAR_DX:
-    case SUBID_XONAR_D2:
-    case SUBID_XONAR_D2X:
-    case SUBID_XONAR_STX:
-    case SUBID_XONAR_DS:
-        /* Must set master clock. */
-        sDac |= XONAR_MCLOCK_256;
-        break;
-    case SUBID_XONAR_ST:
-        sDac |= XONAR_MCLOCK_512;
-    }
-    cmi8788_write_2(sc, I2S_MULTICH_FORMAT, sDac);
-    cmi8788_write_2(sc, I2S_ADC1_FORMAT, sDac);
-    cmi8788_write_2(sc, I2S_ADC2_FORMAT, sDac);
-    cmi8788_write_2(sc, I2S_ADC3_FORMAT, sDac);
+    pcm1796_write(sc, 20, PCM1796_SRST);
+    pcm1796_write(sc,  20, PCM1796_OS_64);
+    pcm1796_write(sc, 18, PCM1796_FMT_24L|PCM1796_ATLD);
+    pcm1796_write(sc, 19, 0);
+}
 
-    /* setup routing regs with default values */
-    cmi8788_write_2(sc, PLAY_ROUTING, 0xE400);
-    cmi8788_write_1(sc, REC_ROUTING, 0x00);
-    cmi8788_write_1(sc, REC_MONITOR, 0x00);
-    cmi8788_write_1(sc, MONITOR_ROUTING, 0xE4);
+/* ST: the DAC master clock comes from a CS2000 */
+static void
+xonar_st_clock_init(struct xonar_info *sc)
+{
+    cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x5, 0x9);
+    cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x2, 0x0);
+    cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x3, 0x0 | (0 << 3) | 0x0 | 0x1);
+    cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x4, (0 << 1) | 0x0);
+    cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x06, 0x00);
+    cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x07, 0x10);
+    cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x08, 0x00);
+    cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x09, 0x00);
+    cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x16, 0x10);
+    cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x17, 0);
+    cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x5, 0x1);
+}
 
-    /* Cold reset onboard AC97 */
-    cmi8788_write_2(sc, AC97_CTRL, AC97_COLD_RESET);
-    count = 100;
-    while ((cmi8788_read_2(sc, AC97_CTRL) & AC97_STATUS_SUSPEND) && (count--))
-    {
-        cmi8788_setandclear_2(sc, AC97_CTRL, AC97_RESUME, AC97_STATUS_SUSPEND);
-        DELAY(100);
-    }
+static void
+xonar_st_init(struct xonar_info *sc)
+{
+    sc->pcm1796_dacs = 1;
 
-    if (!count)
-        device_printf(sc->dev, "AC97 not ready\n");
+    cmi8788_setandclear_1 (sc, FUNCTION, FUNCTION_2WIRE, 0);
+    cmi8788_setandclear_2 (sc, GPIO_CONTROL, 0x01FF, 0);
+    cmi8788_setandclear_2(sc, GPIO_DATA, GPIO_PIN0, GPIO_PIN8);
+    cmi8788_setandclear_2(sc, I2C_CTRL, TWOWIRE_SPEED_FAST, 0);
 
-    sVal = cmi8788_read_2(sc, AC97_CTRL);
+    xonar_st_clock_init(sc);
 
-    /* check if there's an onboard AC97 codec */
-    if (sVal & AC97_CODEC0) {
-        /* FIXME: Set in and out chan config regs to 0 as in OSS driver */
-        cmi8788_write_2 (sc, AC97_OUT_CHAN_CONFIG, 0);
-        cmi8788_write_2 (sc, AC97_IN_CHAN_CONFIG, 0);
-        sc->ac97_codec = AC97_CREATE (sc->dev, sc, xonar_ac97);
-        device_printf(sc->dev, "AC97 codec0 found\n");
-    }
-    /* check if there's an front panel AC97 codec */
-    if (sVal & AC97_CODEC1) {
-        cmi8788_setandclear_2 (sc, AC97_OUT_CHAN_CONFIG, 0x0033, 0);
-        cmi8788_setandclear_2 (sc, AC97_IN_CHAN_CONFIG, 0x0033, 0);
-        device_printf(sc->dev, "AC97 codec1 found\n");
-    }
+    /* Init DAC */
+    pcm1796_write(sc, 20, PCM1796_OS_64);
+    pcm1796_write(sc, 18, PCM1796_FMT_24L|PCM1796_ATLD);
+    pcm1796_write(sc, 19, 0);
+}
 
-    switch (sc->model) {
-    case SUBID_XONAR_STX:
-        sc->anti_pop_delay = 800;
-        sc->output_control_gpio = GPIO_PIN0;
+static void
+xonar_st_resume(struct xonar_info *sc)
+{
+    xonar_st_clock_init(sc);
+    pcm1796_resume(sc);
+}
+
+static void
+xonar_d1_init(struct xonar_info *sc)
+{
+    cmi8788_setandclear_1 (sc, FUNCTION, FUNCTION_2WIRE, 0);
+    cmi8788_setandclear_2 (sc, GPIO_CONTROL, XONAR_D1_OUTPUT_ENABLE |
+                           XONAR_D1_FRONT_PANEL | XONAR_D1_MAGIC |
+                           XONAR_D1_INPUT_ROUTE | GPIO_CS53x1_M_MASK, 0);
+    cmi8788_setandclear_2 (sc, GPIO_DATA, XONAR_D1_OUTPUT_ENABLE,
+                           XONAR_D1_FRONT_PANEL | XONAR_D1_INPUT_ROUTE |
+                           GPIO_CS53x1_M_MASK);
+    cmi8788_setandclear_2(sc, I2C_CTRL, TWOWIRE_SPEED_FAST, 0);
+
+    cs43xx_init(sc);
+}
+
+static void
+xonar_dx_init(struct xonar_info *sc)
+{
+    xonar_d1_init(sc);
 
-        cmi8788_setandclear_1 (sc, FUNCTION, FUNCTION_2WIRE, 0);
-        cmi8788_setandclear_2 (sc, GPIO_CONTROL, 0x018F, 0);
-        cmi8788_setandclear_2(sc, GPIO_DATA, GPIO_PIN0 | GPIO_PIN4 | GPIO_PIN8, 0);
-        cmi8788_setandclear_2(sc, I2C_CTRL, TWOWIRE_SPEED_FAST, 0);
+    if (!(cmi8788_read_1 (sc, GPI_DATA) & XONAR_DX_EXT_POWER))
+        device_printf(sc->dev, "power cable is not connected\n");
+}
 
-        pcm1796_write(sc, 20, PCM1796_SRST);
-        pcm1796_write(sc,  20, PCM1796_OS_64);
-        pcm1796_write(sc, 18, PCM1796_FMT_24L|PCM1796_ATLD);
-        pcm1796_write(sc, 19, 0);
+static void
+xonar_d2_init(struct xonar_info *sc)
+{
+    sc->pcm1796_dacs = 4;
+
+    /* DACs are on SPI, two of them use codec selects 4 and 5 */
+    cmi8788_setandclear_1 (sc, FUNCTION, FUNCTION_SPI | FUNCTION_ENABLE_SPI_4_5,
+                           FUNCTION_2WIRE_SPI_MASK);
+    cmi8788_setandclear_2 (sc, GPIO_CONTROL, XONAR_D2_OUTPUT_ENABLE |
+                           XONAR_D2_ALT | GPIO_CS53x1_M_MASK, 0);
+    cmi8788_setandclear_2 (sc, GPIO_DATA, XONAR_D2_OUTPUT_ENABLE,
+                           XONAR_D2_ALT | GPIO_CS53x1_M_MASK);
+
+    pcm1796_write(sc, 20, PCM1796_SRST);
+    pcm1796_write(sc, 20, PCM1796_OS_64);
+    pcm1796_write(sc, 18, PCM1796_FMT_24L|PCM1796_ATLD);
+    pcm1796_write(sc, 19, 0);
+}
 
-        break;
-    case SUBID_XONAR_ST:
-        sc->anti_pop_delay = 100;
-        sc->output_control_gpio = GPIO_PIN0;
-
-        cmi8788_setandclear_1 (sc, FUNCTION, FUNCTION_2WIRE, 0);
-        cmi8788_setandclear_2 (sc, GPIO_CONTROL, 0x01FF, 0);
-        cmi8788_setandclear_2(sc, GPIO_DATA, GPIO_PIN0, GPIO_PIN8);
-        cmi8788_setandclear_2(sc, I2C_CTRL, TWOWIRE_SPEED_FAST, 0);
-
-        cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x5, 0x9);
-        cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x2, 0x0);
-        cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x3, 0x0 | (0 << 3) | 0x0 | 0x1);
-        cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x4, (0 << 1) | 0x0);
-        cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x06, 0x00);
-        cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x07, 0x10);
-        cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x08, 0x00);
-        cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x09, 0x00);
-        cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x16, 0x10);
-        cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x17, 0);
-        cmi8788_write_i2c(sc, XONAR_ST_CLOCK, 0x5, 0x1);
-
-        /* Init DAC */
-        pcm1796_write(sc, 20, PCM1796_OS_64);
-        pcm1796_write(sc, 18, PCM1796_FMT_24L|PCM1796_ATLD);
-        pcm1796_write(sc, 19, 0);
+static void
+xonar_d2x_init(struct xonar_info *sc)
+{
+    xonar_d2_init(sc);
+
+    if (!(cmi8788_read_2 (sc, GPIO_DATA) & XONAR_D2X_EXT_POWER))
+        device_printf(sc->dev, "power cable is not connected\n");
+}
+
+static void
+xonar_generic_init(struct xonar_info *sc)
+{
+    cmi8788_setandclear_1 (sc, REC_ROUTING, 0x18, 0);
+}
+
+#define PCM1796_OPS                             \
+    .set_volume  = pcm1796_set_volume,          \
+    .get_mute    = pcm1796_get_mute,            \
+    .set_mute    = pcm1796_set_mute,            \
+    .get_rolloff = pcm1796_get_rolloff,         \
+    .set_rolloff = pcm1796_set_rolloff,         \
+    .set_rate    = pcm1796_set_rate,            \
+    .set_power   = pcm1796_set_power,           \
+    .get_inzd    = pcm1796_get_inzd,            \
+    .set_inzd    = pcm1796_set_inzd
+
+#define CS43XX_OPS                              \
+    .set_volume  = cs43xx_set_volume,           \
+    .get_mute    = cs43xx_get_mute,             \
+    .set_mute    = cs43xx_set_mute,             \
+    .get_rolloff = cs43xx_get_rolloff,          \
+    .set_rolloff = cs43xx_set_rolloff,          \
+    .set_rate    = cs43xx_set_rate,             \
+    .set_power   = cs43xx_set_power
+
+#define OUTPUTS_ALL ((1 << OUTPUT_LINE) | (1 << OUTPUT_REAR_HP) | (1 << OUTPUT_HP))
+
+static const struct xonar_model xonar_models[] = {
+    {
+        .subid = SUBID_XONAR_STX,
+        .desc = "Asus Xonar Essence STX (AV100)",
+        .init = xonar_stx_init,
+        .resume = pcm1796_resume,
+        PCM1796_OPS,
+        .dac_bus = XONAR_BUS_I2C,
+        .front_dac = XONAR_STX_FRONTDAC,
+        .output_enable_gpio = GPIO_PIN0,
+        .input_route_gpio = GPIO_PIN8,
+        /*
+         * GPIO1 - front (0) or rear (1) HP jack
+         * GPIO7 - speakers (0) or HP (1)
+         */
+        .output_gpio_mask = GPIO_PIN7 | GPIO_PIN1,
+        .output_gpio = { 0, GPIO_PIN7 | GPIO_PIN1, GPIO_PIN7 },
+        .outputs = OUTPUTS_ALL,
+        .anti_pop_delay = 800,
+        .mclk = XONAR_MCLOCK_256,
+        .adc_type = 2,
+        .play_caps = &xonar_caps,
+    },
+    {
+        .subid = SUBID_XONAR_ST,
+        .desc = "Asus Xonar Essence ST (AV100)",
+        .init = xonar_st_init,
+        .resume = xonar_st_resume,
+        PCM1796_OPS,
+        .dac_bus = XONAR_BUS_I2C,
+        .front_dac = XONAR_ST_FRONTDAC,
+        .output_enable_gpio = GPIO_PIN0,
+        .input_route_gpio = GPIO_PIN8,
+        .output_gpio_mask = GPIO_PIN7 | GPIO_PIN1,
+        .output_gpio = { 0, GPIO_PIN7 | GPIO_PIN1, GPIO_PIN7 },
+        .outputs = OUTPUTS_ALL,
+        .anti_pop_delay = 100,
+        .mclk = XONAR_MCLOCK_512,
+        .adc_type = 2,
+        .play_caps = &xonar_caps,
+    },
+    {
+        .subid = SUBID_XONAR_D1,
+        .desc = "Asus Xonar D1 (AV100)",
+        .init = xonar_d1_init,
+        .resume = cs43xx_resume,
+        CS43XX_OPS,
+        .dac_bus = XONAR_BUS_I2C,
+        .front_dac = XONAR_DX_FRONTDAC,
+        .surr_dac = XONAR_DX_SURRDAC,
+        .output_enable_gpio = XONAR_D1_OUTPUT_ENABLE,
+        .input_route_gpio = XONAR_D1_INPUT_ROUTE,
+        /* Headphones are on the front panel only */
+        .output_gpio_mask = XONAR_D1_FRONT_PANEL,
+        .output_gpio = { 0, 0, XONAR_D1_FRONT_PANEL },
+        .outputs = (1 << OUTPUT_LINE) | (1 << OUTPUT_HP),
+        .anti_pop_delay = 800,
+        .mclk = XONAR_MCLOCK_256,
+        .adc_type = 2,
+        .play_caps = &xonar_caps_multich,
+    },
+    {
+        .subid = SUBID_XONAR_DX,
+        .desc = "Asus Xonar DX (AV100)",
+        .init = xonar_dx_init,
+        .resume = cs43xx_resume,
+        .power_gpi = XONAR_DX_EXT_POWER,
+        CS43XX_OPS,
+        .dac_bus = XONAR_BUS_I2C,
+        .front_dac = XONAR_DX_FRONTDAC,
+        .surr_dac = XONAR_DX_SURRDAC,
+        .output_enable_gpio = XONAR_D1_OUTPUT_ENABLE,
+        .input_route_gpio = XONAR_D1_INPUT_ROUTE,
+        .output_gpio_mask = XONAR_D1_FRONT_PANEL,
+        .output_gpio = { 0, 0, XONAR_D1_FRONT_PANEL },
+        .outputs = (1 << OUTPUT_LINE) | (1 << OUTPUT_HP),
+        .anti_pop_delay = 800,
+        .mclk = XONAR_MCLOCK_256,
+        .adc_type = 2,
+        .play_caps = &xonar_caps_multich,
+    },
+    {
+        .subid = SUBID_XONAR_D2,
+        .desc = "Asus Xonar D2 (AV200)",
+        .init = xonar_d2_init,
+        .resume = pcm1796_resume,
+        PCM1796_OPS,
+        .dac_bus = XONAR_BUS_SPI,
+        /* GPIO8 is the output relay here, input is routed in AC97 */
+        .output_enable_gpio = XONAR_D2_OUTPUT_ENABLE,
+        .outputs = (1 << OUTPUT_LINE),
+        .anti_pop_delay = 300,
+        .mclk = XONAR_MCLOCK_256,
+        .adc_type = 2,
+        .play_caps = &xonar_caps_multich,
+    },
+    {
+        .subid = SUBID_XONAR_D2X,
+        .desc = "Asus Xonar D2X (AV200)",
+        .init = xonar_d2x_init,
+        .resume = pcm1796_resume,
+        .power_gpio = XONAR_D2X_EXT_POWER,
+        PCM1796_OPS,
+        .dac_bus = XONAR_BUS_SPI,
+        .output_enable_gpio = XONAR_D2_OUTPUT_ENABLE,
+        .outputs = (1 << OUTPUT_LINE),
+        .anti_pop_delay = 300,
+        .mclk = XONAR_MCLOCK_256,
+        .adc_type = 2,
+        .play_caps = &xonar_caps_multich,
+    },
+    /* it shouldn't be too hard to add others, e.g. DS (AV66) */
+};
+
+static const struct xonar_model xonar_generic = {
+    .subid = SUBID_GENERIC,
+    .desc = NULL,
+    .init = xonar_generic_init,
+    .resume = null_resume,
+    .set_volume  = null_set_volume,
+    .get_mute    = null_get,
+    .set_mute    = null_set,
+    .get_rolloff = null_get,
+    .set_rolloff = null_set,
+    .set_rate    = null_set_rate,
+    .set_power   = null_set_power,
+    .outputs = (1 << OUTPUT_LINE),
+    .adc_type = 1,
+    .play_caps = &xonar_caps,
+};
+
+static const struct xonar_model *
+xonar_find_model(device_t dev)
+{
+    int i;
+
+    if (pci_get_subvendor(dev) != ASUS_VENDOR_ID)
+        return &xonar_generic;
+
+    for (i = 0; i < ARRAY_SIZE (xonar_models); i++) {
+        if (pci_get_subdevice(dev) == xonar_models[i].subid)
+            return &xonar_models[i];
+    }
+    return &xonar_generic;
+}
+
+/* Cold reset the onboard AC97 link, returns AC97_CTRL */
+static uint16_t
+xonar_ac97_reset(struct xonar_info *sc)
+{
+    int count;
+
+    cmi8788_write_2(sc, AC97_CTRL, AC97_COLD_RESET);
+    count = 100;
+    while ((cmi8788_read_2(sc, AC97_CTRL) & AC97_STATUS_SUSPEND) && (count--))
+    {
+        cmi8788_setandclear_2(sc, AC97_CTRL, AC97_RESUME, AC97_STATUS_SUSPEND);
+        DELAY(100);
+    }
+
+    if (!count)
+        device_printf(sc->dev, "AC97 not ready\n");
+
+    return cmi8788_read_2(sc, AC97_CTRL);
+}
+
+static int
+xonar_init(struct xonar_info *sc)
+{
+    uint16_t sVal;
+    uint16_t sDac;
+    uint8_t bVal;
+
+    /* Init CMI controller */
+    sVal = cmi8788_read_2(sc, CTRL_VERSION);
+    if (!(sVal & CTRL_VERSION2)) {
+        bVal = cmi8788_read_1(sc, MISC_REG);
+        bVal |= MISC_PCI_MEM_W_1_CLOCK;
+        cmi8788_write_1(sc, MISC_REG, bVal);
+    }
+    bVal = cmi8788_read_1(sc, FUNCTION);
+    bVal |= FUNCTION_RESET_CODEC;
+    cmi8788_write_1(sc, FUNCTION, bVal);
+
+    /* set up DAC related settings */
+    sDac = I2S_MASTER | I2S_FMT_RATE48 | I2S_FMT_LJUST | I2S_FMT_BITS16;
+
+    /* Must set master clock. */
+    sDac |= sc->hw->mclk;
+    cmi8788_write_2(sc, I2S_MULTICH_FORMAT, sDac);
+    cmi8788_write_2(sc, I2S_ADC1_FORMAT, sDac);
+    cmi8788_write_2(sc, I2S_ADC2_FORMAT, sDac);
+    cmi8788_write_2(sc, I2S_ADC3_FORMAT, sDac);
+
+    /* setup routing regs with default values */
+    cmi8788_write_2(sc, PLAY_ROUTING, 0xE400);
+    cmi8788_write_1(sc, REC_ROUTING, 0x00);
+    cmi8788_write_1(sc, REC_MONITOR, 0x00);
+    cmi8788_write_1(sc, MONITOR_ROUTING, MONITOR_ROUTING_DEFAULT);
+    sc->monitor_src = MONITOR_SRC_LINE;
+    sc->monitor_atten = 1;
+
+    /* S/PDIF out plays PCM at 48kHz until its channel is set up */
+    cmi8788_write_4(sc, SPDIFOUT_CHAN_STAT, SPDIF_CS_COPY | SPDIF_CS_ORIGINAL |
+                    SPDIF_CS_CATEGORY_PCM |
+                    (spdif_cs_rates[I2S_FMT_RATE48] << SPDIF_CS_RATE_SHIFT));
+    xonar_spdif_func(sc, SPDIF_OUT_ENABLE |
+                     (I2S_FMT_RATE48 << SPDIF_OUT_RATE_SHIFT),
+                     SPDIF_OUT_RATE_MASK | SPDIF_LOOPBACK);
+
+    /* S/PDIF in goes to RECC; report signal, lock and rate changes */
+    sc->spdif_in_caps.minspeed = XONAR_RATE_MIN;
+    sc->spdif_in_caps.maxspeed = XONAR_RATE_MAX;
+    sc->spdif_in_caps.fmtlist = xonar_fmt_spdif_in;
+    xonar_spdif_func(sc, SPDIF_SENSE_MASK | SPDIF_LOCK_MASK | SPDIF_RATE_MASK, 0);
+
+    sVal = xonar_ac97_reset(sc);
+    sc->ac97_codecs = sVal & (AC97_CODEC0 | AC97_CODEC1);
+
+    /* check if there's an onboard AC97 codec */
+    if (sVal & AC97_CODEC0) {
+        /* FIXME: Set in and out chan config regs to 0 as in OSS driver */
+        cmi8788_write_2 (sc, AC97_OUT_CHAN_CONFIG, 0);
+        cmi8788_write_2 (sc, AC97_IN_CHAN_CONFIG, 0);
+        sc->ac97_codec = AC97_CREATE (sc->dev, sc, xonar_ac97);
+        device_printf(sc->dev, "AC97 codec0 found\n");
+    }
+    /* check if there's an front panel AC97 codec */
+    if (sVal & AC97_CODEC1) {
+        cmi8788_setandclear_2 (sc, AC97_OUT_CHAN_CONFIG, 0x0033, 0);
+        cmi8788_setandclear_2 (sc, AC97_IN_CHAN_CONFIG, 0x0033, 0);
+        device_printf(sc->dev, "AC97 codec1 found\n");
     }
 
+    sc->hw->init(sc);
+
+    sc->pcm_vol[0] = sc->pcm_vol[1] = 100;
     sc->vol_offset_hp = 0;
     sc->vol_scale_hp = 255;
     sc->vol_offset_line = 0;
     sc->vol_scale_line = 255;
-    pcm1796_set_volume(sc, 75, 75);
+    sc->hw->set_volume(sc, 75, 75);
 
     /* check if MPU401 is enabled in MISC register */
     if (cmi8788_read_1 (sc, MISC_REG) & MISC_MIDI)
@@ -1004,17 +2551,60 @@ xonar_init(struct xonar_info *sc)
     return (0);
 }
 
+/*
+ * Allocate a DMA buffer of the given XONAR_DMA_MEM_* type. Write-combining
+ * is an x86 page attribute, elsewhere such buffers are just uncached. The
+ * buffer is allocated uncached first so it always gets pages of its own
+ * before their attribute is changed.
+ */
+static int
+xonar_dma_alloc(struct xonar_info *sc, int mem, void **buf,
+                bus_dmamap_t *map, int flags)
+{
+    if (mem == XONAR_DMA_MEM_COHERENT)
+        flags |= BUS_DMA_COHERENT;
+    else if (mem == XONAR_DMA_MEM_WC)
+        flags |= BUS_DMA_NOCACHE;
+    if (bus_dmamem_alloc(sc->dmat, buf, flags, map) != 0)
+        return ENOMEM;
+#if defined(__amd64__) || defined(__i386__)
+    if (mem == XONAR_DMA_MEM_WC &&
+        pmap_change_attr((vm_offset_t)*buf, 2 * sc->bufsz,
+                         VM_MEMATTR_WRITE_COMBINING) != 0)
+        device_printf(sc->dev, "write-combining unavailable, buffer is uncached\n");
+#endif
+    return 0;
+}
+
+static void
+xonar_dma_free(struct xonar_info *sc, int mem, void *buf, bus_dmamap_t map)
+{
+#if defined(__amd64__) || defined(__i386__)
+    /* Hand the pages back the way bus_dmamem_alloc made them */
+    if (mem == XONAR_DMA_MEM_WC)
+        pmap_change_attr((vm_offset_t)buf, 2 * sc->bufsz,
+                         VM_MEMATTR_UNCACHEABLE);
+#endif
+    bus_dmamem_free(sc->dmat, buf, map);
+}
+
 static void
 xonar_cleanup(struct xonar_info *sc)
 {
     int i;
 
-    for (i=0; i<2; i++)
+    if (sc->mpu != NULL)
+        mpu401_uninit(sc->mpu);
+    if (sc->status_dev != NULL)
+        destroy_dev(sc->status_dev);
+    device_delete_children(sc->dev);
+
+    for (i=0; i<MAX_PORTS_PLAY+MAX_PORTS_REC; i++)
     {
         /* FIXME: Is this OK? */
         if (sc->dma_map[i] != NULL) {
             bus_dmamap_unload (sc->dmat, sc->dma_map[i]);
-            bus_dmamem_free (sc->dmat, sc->buf[i], sc->dma_map[i]);
+            xonar_dma_free (sc, sc->dma_mem, sc->buf[i], sc->dma_map[i]);
             sc->buf[i] = NULL;
             sc->dma_map[i] = NULL;
         }
@@ -1036,6 +2626,7 @@ xonar_cleanup(struct xonar_info *sc)
         bus_release_resource(sc->dev, SYS_RES_IRQ, sc->irqid, sc->irq);
         sc->irq = NULL;
     }
+    xonar_status_free(sc);
     if (sc->lock) {
         snd_mtxfree(sc->lock);
         sc->lock = NULL;
@@ -1053,30 +2644,691 @@ xonar_cleanup(struct xonar_info *sc)
 }
 
 static int
-sysctl_xonar_mute(SYSCTL_HANDLER_ARGS)
+sysctl_xonar_mute(SYSCTL_HANDLER_ARGS)
+{
+    struct xonar_info *sc;
+    device_t dev;
+    int val, err, ok;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    val = sc->hw->get_mute (sc);
+    if (val == -1)
+        return EINVAL;
+    err = sysctl_handle_int(oidp, &val, 0, req);
+    if (err || req->newptr == NULL)
+        return (err);
+    if (val < 0 || val > 1)
+        return (EINVAL);
+    snd_mtxlock(sc->lock);
+    ok = sc->hw->set_mute(sc, val) == 0;
+    if (ok)
+        sc->dop_muted = 0;      /* the user's choice sticks */
+    snd_mtxunlock(sc->lock);
+    if (ok)
+        xonar_notify(sc, "MUTE", val);
+    return err;
+}
+
+static int
+sysctl_xonar_rec_monitor(SYSCTL_HANDLER_ARGS)
+{
+    struct xonar_info *sc;
+    device_t dev;
+    int val, err;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    val = sc->monitor;
+    err = sysctl_handle_int(oidp, &val, 0, req);
+    if (err || req->newptr == NULL)
+        return (err);
+    if (val < 0 || val > 1)
+        return (EINVAL);
+    snd_mtxlock(sc->lock);
+    sc->monitor = val;
+    cmi8788_update_monitor(sc);
+    if (val)
+        xonar_wake(sc);
+    else
+        xonar_idle_arm(sc);
+    snd_mtxunlock(sc->lock);
+    xonar_monitor_input(sc);
+    return err;
+}
+
+static int
+sysctl_xonar_monitor_src(SYSCTL_HANDLER_ARGS)
+{
+    struct xonar_info *sc;
+    device_t dev;
+    int val, err, i;
+    char buf[20];
+    char *endptr;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    val = sc->monitor_src;
+
+    strncpy (buf, monitor_src_str[val], sizeof (buf));
+    err = sysctl_handle_string(oidp, buf, sizeof(buf), req);
+    if (err || req->newptr == NULL)
+        return (err);
+
+    if (buf[0] == '\0')
+        return EINVAL;
+    val = strtol (buf, &endptr, 10);
+    if (*endptr != '\0') {
+        val = -1;
+        for (i = 0; i < ARRAY_SIZE (monitor_src_str); i++) {
+            if (strncmp (buf, monitor_src_str[i], sizeof (buf)) == 0) {
+                val = i;
+                break;
+            }
+        }
+    }
+
+    if (val < 0 || val >= ARRAY_SIZE (monitor_src_str))
+        return EINVAL;
+    snd_mtxlock(sc->lock);
+    sc->monitor_src = val;
+    cmi8788_update_monitor(sc);
+    snd_mtxunlock(sc->lock);
+    xonar_monitor_input(sc);
+    return err;
+}
+
+static int
+sysctl_xonar_monitor_atten(SYSCTL_HANDLER_ARGS)
+{
+    struct xonar_info *sc;
+    device_t dev;
+    int val, err;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    val = sc->monitor_atten ? 6 : 0;
+    err = sysctl_handle_int(oidp, &val, 0, req);
+    if (err || req->newptr == NULL)
+        return (err);
+    if (val != 0 && val != 6)
+        return (EINVAL);
+    snd_mtxlock(sc->lock);
+    sc->monitor_atten = (val != 0);
+    cmi8788_update_monitor(sc);
+    snd_mtxunlock(sc->lock);
+    return err;
+}
+
+static int
+sysctl_xonar_monitor_dest(SYSCTL_HANDLER_ARGS)
+{
+    struct xonar_info *sc;
+    device_t dev;
+    int val, err;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    val = sc->monitor_dest;
+    err = sysctl_handle_int(oidp, &val, 0, req);
+    if (err || req->newptr == NULL)
+        return (err);
+    if (val < 0 || val > 3)
+        return (EINVAL);
+    snd_mtxlock(sc->lock);
+    sc->monitor_dest = val;
+    cmi8788_update_monitor(sc);
+    snd_mtxunlock(sc->lock);
+    return err;
+}
+
+static int
+sysctl_xonar_inzd(SYSCTL_HANDLER_ARGS)
+{
+    struct xonar_info *sc;
+    device_t dev;
+    int val, err;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    val = sc->hw->get_inzd (sc);
+    if (val == -1)
+        return EINVAL;
+    err = sysctl_handle_int(oidp, &val, 0, req);
+    if (err || req->newptr == NULL)
+        return (err);
+    if (val < 0 || val > 1)
+        return (EINVAL);
+    sc->hw->set_inzd(sc, val);
+    return err;
+}
+
+
+static int
+sysctl_xonar_output(SYSCTL_HANDLER_ARGS) 
+{
+    struct xonar_info *sc;
+    device_t dev;
+    int val, old_val, err, i;
+    char buf[20];
+    char *endptr;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    val = cmi8788_get_output (sc);
+
+    if (val < 0 || val >= ARRAY_SIZE (output_str))
+        return EINVAL;
+
+    strncpy (buf, output_str[val], sizeof(buf));
+    err = sysctl_handle_string(oidp, buf, sizeof(buf), req);
+    if (err || req->newptr == NULL)
+        return (err);
+
+    old_val = val;
+    if (buf[0] == '\0') return EINVAL;
+    val = strtol (buf, &endptr, 10);
+    if (*endptr != '\0') {
+        val = -1;
+        for (i = 0; i < ARRAY_SIZE (output_str); i++) {
+            if (strncmp (buf, output_str[i], sizeof (buf)) == 0) {
+                val = i;
+                break;
+            }
+        }
+    }
+    if (val < 0 || val > ARRAY_SIZE (output_str))
+        return (EINVAL);
+    if (val != old_val) err = cmi8788_set_output(sc, val);
+    return err;
+}
+
+static int
+sysctl_xonar_rolloff(SYSCTL_HANDLER_ARGS) 
+{
+    struct xonar_info *sc;
+    device_t dev;
+    int val, err, i;
+    char buf[20];
+    char *endptr;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    val = sc->hw->get_rolloff (sc);
+
+    if (val < 0 || val >= ARRAY_SIZE(rolloff_str))
+        return EINVAL;
+
+    strncpy (buf, rolloff_str[val], sizeof (buf));
+    err = sysctl_handle_string(oidp, buf, sizeof(buf), req);
+    if (err || req->newptr == NULL)
+        return (err);
+
+    if (buf[0] == '\0')
+        return EINVAL;
+    val = strtol (buf, &endptr, 10);
+    if (*endptr != '\0') {
+        val = -1;
+        for (i = 0; i < ARRAY_SIZE (rolloff_str); i++) {
+            if (strncmp (buf, rolloff_str[i], sizeof (buf)) == 0) {
+                val = i;
+                break;
+            }
+        }
+    }
+
+    if ((val < 0) || (val > 1))
+        return EINVAL;
+    sc->hw->set_rolloff (sc, val);
+    return err;
+}
+
+/*
+ * Exclusive mode hands the multichannel DMA engine to a single client:
+ * vchans are disabled and the device is made bitperfect, so the feeder
+ * chain does no volume, rate or matrix conversion. The sound system
+ * keeps both settings, so they are read back rather than cached here.
+ */
+static int
+xonar_get_vchans(struct xonar_info *sc, int *vchans)
+{
+    char name[64];
+    size_t len = sizeof(*vchans);
+
+    snprintf(name, sizeof(name), "dev.pcm.%d.play.vchans",
+             device_get_unit(sc->dev));
+    return kernel_sysctlbyname(curthread, name, vchans, &len, NULL, 0,
+                               NULL, 0);
+}
+
+static int
+xonar_set_vchans(struct xonar_info *sc, int vchans)
+{
+    char name[64];
+
+    snprintf(name, sizeof(name), "dev.pcm.%d.play.vchans",
+             device_get_unit(sc->dev));
+    return kernel_sysctlbyname(curthread, name, NULL, NULL,
+                               &vchans, sizeof(vchans), NULL, 0);
+}
+
+static int
+xonar_get_exclusive(struct xonar_info *sc)
+{
+    int vchans;
+
+    if (!(pcm_getflags(sc->dev) & SD_F_BITPERFECT))
+        return 0;
+    return xonar_get_vchans(sc, &vchans) == 0 && vchans == 0;
+}
+
+static int
+xonar_set_exclusive(struct xonar_info *sc, int val)
+{
+    char name[64];
+    int bitperfect = val, old_vchans;
+    int err;
+
+    if ((err = xonar_get_vchans(sc, &old_vchans)))
+        return err;
+
+    /* vchans must go first, bitperfect can't be set while they are in use */
+    if (val && old_vchans && (err = xonar_set_vchans(sc, 0)))
+        return err;
+    snprintf(name, sizeof(name), "dev.pcm.%d.bitperfect",
+             device_get_unit(sc->dev));
+    if ((err = kernel_sysctlbyname(curthread, name, NULL, NULL,
+                                   &bitperfect, sizeof(bitperfect), NULL, 0))) {
+        if (val && old_vchans)
+            xonar_set_vchans(sc, old_vchans);
+        return err;
+    }
+    if (!val && !old_vchans && (err = xonar_set_vchans(sc, 1))) {
+        bitperfect = 1;
+        kernel_sysctlbyname(curthread, name, NULL, NULL,
+                            &bitperfect, sizeof(bitperfect), NULL, 0);
+        return err;
+    }
+    return 0;
+}
+
+static int
+sysctl_xonar_exclusive(SYSCTL_HANDLER_ARGS)
+{
+    struct xonar_info *sc;
+    device_t dev;
+    int val, old_val, err;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    val = old_val = xonar_get_exclusive(sc);
+    err = sysctl_handle_int(oidp, &val, 0, req);
+    if (err || req->newptr == NULL)
+        return (err);
+    if (val < 0 || val > 1)
+        return (EINVAL);
+    if (val == old_val)
+        return 0;
+    return xonar_set_exclusive(sc, val);
+}
+
+/*
+ * The playback stream is bitperfect when it owns the hardware channel
+ * and its format and rate are exactly what the DMA engine is fed with.
+ */
+static int
+sysctl_xonar_bitperfect_active(SYSCTL_HANDLER_ARGS)
+{
+    struct xonar_info *sc;
+    struct xonar_chinfo *ch;
+    struct pcm_channel *c;
+    device_t dev;
+    int val = 0;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    ch = &sc->chan[XONAR_CHAN_MULTICH];
+    c = ch->channel;
+    if (c != NULL && ch->state == CHAN_STATE_ACTIVE) {
+        CHN_LOCK(c);
+        val = CHN_BITPERFECT(c) && !(c->flags & CHN_F_HAS_VCHAN) &&
+            c->format == ch->fmt && c->speed == ch->spd;
+        CHN_UNLOCK(c);
+    }
+    return sysctl_handle_int(oidp, &val, 0, req);
+}
+
+/*
+ * Debug aid: writing 1 reads every shadowed control register back from
+ * the chip and logs the mismatches. Reading gives the last count.
+ */
+static int
+sysctl_xonar_shadow_check(SYSCTL_HANDLER_ARGS)
+{
+    struct xonar_info *sc;
+    device_t dev;
+    int val, err;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    val = sc->shadow_bad;
+    err = sysctl_handle_int(oidp, &val, 0, req);
+    if (err || req->newptr == NULL)
+        return (err);
+    if (val != 1)
+        return (EINVAL);
+    snd_mtxlock(sc->lock);
+    sc->shadow_bad = cmi8788_shadow_check(sc);
+    snd_mtxunlock(sc->lock);
+    return 0;
+}
+
+/*
+ * Writing "run" copies XONAR_DMA_BENCH_BYTES into a fresh buffer of each
+ * memory type, a block at a time with the same sync the feeder path
+ * does, and keeps the throughput in MB/s for reading.
+ */
+static int
+sysctl_xonar_dma_bench(SYSCTL_HANDLER_ARGS)
+{
+    struct xonar_info *sc;
+    device_t dev;
+    bus_dmamap_t map;
+    sbintime_t t;
+    char out[128], cmd[8];
+    void *src, *dst;
+    int i, n, len, loops, blksz, err;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    cmd[0] = '\0';
+    if (req->newptr == NULL)
+        return sysctl_handle_string(oidp, sc->dma_bench, sizeof(sc->dma_bench), req);
+    err = sysctl_handle_string(oidp, cmd, sizeof(cmd), req);
+    if (err)
+        return err;
+    if (strcmp(cmd, "run") != 0)
+        return EINVAL;
+
+    blksz = sc->bufsz;
+    loops = XONAR_DMA_BENCH_BYTES / blksz;
+    src = malloc(blksz, M_DEVBUF, M_WAITOK | M_ZERO);
+    len = 0;
+    out[0] = '\0';
+    for (i = 0; i < ARRAY_SIZE(dma_mem_str); i++) {
+        if (xonar_dma_alloc(sc, i, &dst, &map, BUS_DMA_WAITOK) != 0) {
+            len += snprintf(out + len, sizeof(out) - len, "%s%s: -",
+                            len ? ", " : "", dma_mem_str[i]);
+            continue;
+        }
+        t = sbinuptime();
+        for (n = 0; n < loops; n++) {
+            memcpy(dst, src, blksz);
+            bus_dmamap_sync(sc->dmat, map, BUS_DMASYNC_PREWRITE);
+        }
+        t = sbinuptime() - t;
+        xonar_dma_free(sc, i, dst, map);
+        len += snprintf(out + len, sizeof(out) - len, "%s%s: %ju",
+                        len ? ", " : "", dma_mem_str[i],
+                        (uintmax_t)loops * blksz * 1000 /
+                        MAX(sbttons(t), 1));
+    }
+    free(src, M_DEVBUF);
+    strlcpy(sc->dma_bench, out, sizeof(sc->dma_bench));
+    return 0;
+}
+
+/*
+ * Arm a scheduled start: channels triggered before the deadline (in ns
+ * of uptime, as sbinuptime()) are prepared right away, their DMA is
+ * started from a callout at the deadline. 0 disarms.
+ */
+static int
+sysctl_xonar_start_at(SYSCTL_HANDLER_ARGS)
+{
+    struct xonar_info *sc;
+    device_t dev;
+    int64_t val;
+    int err;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    val = sc->start_at ? sbttons(sc->start_at) : 0;
+    err = sysctl_handle_64(oidp, &val, 0, req);
+    if (err || req->newptr == NULL)
+        return (err);
+    if (val < 0)
+        return (EINVAL);
+
+    snd_mtxlock(sc->lock);
+    if (callout_pending(&sc->start_callout)) {
+        /* Too late to move it, the channels are waiting for it */
+        snd_mtxunlock(sc->lock);
+        return (EBUSY);
+    }
+    sc->start_at = val ? nstosbt(val) : 0;
+    snd_mtxunlock(sc->lock);
+    return err;
+}
+
+static int
+sysctl_xonar_idle_timeout(SYSCTL_HANDLER_ARGS)
+{
+    struct xonar_info *sc;
+    device_t dev;
+    int val, err;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+    val = sc->idle_timeout;
+    err = sysctl_handle_int(oidp, &val, 0, req);
+    if (err || req->newptr == NULL)
+        return (err);
+    if (val < 0 || val > 86400)
+        return (EINVAL);
+
+    snd_mtxlock(sc->lock);
+    sc->idle_timeout = val;
+    if (val == 0)
+        xonar_wake(sc);
+    else
+        xonar_idle_arm(sc);
+    snd_mtxunlock(sc->lock);
+    return err;
+}
+
+/*
+ * All driver settings in one string, for saving and restoring them in a
+ * single call. It starts with XONAR_STATE_VERSION and its fields are
+ * only meant to be fed back, so they are positional:
+ *   output rolloff mute inzd exclusive spdif_mirror
+ *   vol_offset_line vol_scale_line vol_offset_hp vol_scale_hp
+ *   monitor monitor_source monitor_atten monitor_dest idle_timeout
+ * A new state is checked as a whole before anything is applied, and
+ * only what differs from the current settings touches the hardware.
+ * Exclusive mode goes last, so a failing output switch leaves it alone.
+ */
+static int
+sysctl_xonar_state(SYSCTL_HANDLER_ARGS)
+{
+    struct xonar_info *sc;
+    device_t dev;
+    char buf[128], *p, *endptr;
+    int v[XONAR_STATE_FIELDS];
+    int i, err, version, inzd, exclusive, vol, mon;
+
+    dev = oidp->oid_arg1;
+    sc = pcm_getdevinfo(dev);
+    if (sc == NULL)
+        return EINVAL;
+
+    inzd = (sc->hw->get_inzd != NULL) ? sc->hw->get_inzd(sc) : 0;
+    exclusive = xonar_get_exclusive(sc);
+    snd_mtxlock(sc->lock);
+    snprintf(buf, sizeof(buf), "%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d",
+             XONAR_STATE_VERSION, cmi8788_get_output(sc),
+             sc->hw->get_rolloff(sc), sc->hw->get_mute(sc), inzd,
+             exclusive, sc->spdif_mirror,
+             sc->vol_offset_line, sc->vol_scale_line,
+             sc->vol_offset_hp, sc->vol_scale_hp,
+             sc->monitor, sc->monitor_src, sc->monitor_atten,
+             sc->monitor_dest, sc->idle_timeout);
+    snd_mtxunlock(sc->lock);
+    err = sysctl_handle_string(oidp, buf, sizeof(buf), req);
+    if (err || req->newptr == NULL)
+        return (err);
+
+    version = strtol(buf, &endptr, 10);
+    if (endptr == buf || version != XONAR_STATE_VERSION)
+        return (EINVAL);
+    for (i = 0; i < XONAR_STATE_FIELDS; i++) {
+        p = endptr;
+        v[i] = strtol(p, &endptr, 10);
+        if (endptr == p)
+            return (EINVAL);
+    }
+    if (*endptr != '\0' && *endptr != '\n')
+        return (EINVAL);
+
+    if (v[0] < 0 || v[0] >= ARRAY_SIZE(output_str) ||
+        !(sc->hw->outputs & (1 << v[0])) ||
+        v[1] < 0 || v[1] > 1 || v[2] < 0 || v[2] > 1 ||
+        v[3] < 0 || v[3] > 1 || v[4] < 0 || v[4] > 1 ||
+        v[5] < 0 || v[5] > 1 || v[10] < 0 || v[10] > 1 ||
+        v[11] < 0 || v[11] >= ARRAY_SIZE(monitor_src_str) ||
+        v[12] < 0 || v[12] > 1 || v[13] < 0 || v[13] > 3 ||
+        v[14] < 0 || v[14] > 86400)
+        return (EINVAL);
+
+    snd_mtxlock(sc->lock);
+    if (sc->spdif_mirror != v[5]) {
+        sc->spdif_mirror = v[5];
+        xonar_spdif_route(sc);
+    }
+    vol = sc->vol_offset_line != v[6] || sc->vol_scale_line != v[7] ||
+        sc->vol_offset_hp != v[8] || sc->vol_scale_hp != v[9];
+    sc->vol_offset_line = v[6];
+    sc->vol_scale_line = v[7];
+    sc->vol_offset_hp = v[8];
+    sc->vol_scale_hp = v[9];
+    mon = sc->monitor != v[10] || sc->monitor_src != v[11];
+    if (mon || sc->monitor_atten != v[12] || sc->monitor_dest != v[13]) {
+        sc->monitor = v[10];
+        sc->monitor_src = v[11];
+        sc->monitor_atten = v[12];
+        sc->monitor_dest = v[13];
+        cmi8788_update_monitor(sc);
+    }
+    if (sc->hw->get_rolloff(sc) != v[1])
+        sc->hw->set_rolloff(sc, v[1]);
+    if (sc->hw->get_mute(sc) != v[2] && sc->hw->set_mute(sc, v[2]) == 0)
+        xonar_notify(sc, "MUTE", v[2]);
+    sc->dop_muted = 0;          /* the user's choice sticks */
+    if (sc->hw->get_inzd != NULL && inzd != v[3])
+        sc->hw->set_inzd(sc, v[3]);
+    if (mon || sc->idle_timeout != v[14]) {
+        sc->idle_timeout = v[14];
+        if (v[14] == 0 || sc->monitor)
+            xonar_wake(sc);
+        else
+            xonar_idle_arm(sc);
+    }
+    snd_mtxunlock(sc->lock);
+    if (mon)
+        xonar_monitor_input(sc);
+
+    /* Switching outputs sleeps for the relay and sets the volume itself */
+    if (v[0] != cmi8788_get_output(sc)) {
+        if ((err = cmi8788_set_output(sc, v[0])))
+            return err;
+    } else if (vol)
+        sc->hw->set_volume(sc, sc->vol[0], sc->vol[1]);
+
+    if (v[4] != exclusive)
+        return xonar_set_exclusive(sc, v[4]);
+    return 0;
+}
+
+/*
+ * Hand out the MIDI bytes received and not yet consumed, with their
+ * arrival times, as an array of struct xonar_midi_event. Reading leaves
+ * them in place; writing an int n drops the oldest n, so a reader
+ * consumes exactly what it has seen.
+ */
+static int
+sysctl_xonar_midi_input(SYSCTL_HANDLER_ARGS)
 {
     struct xonar_info *sc;
+    struct xonar_midi_event *ev;
     device_t dev;
-    int val, err;
+    u_int head, tail, n;
+    int err, val;
 
     dev = oidp->oid_arg1;
     sc = pcm_getdevinfo(dev);
     if (sc == NULL)
         return EINVAL;
-    val = pcm1796_get_mute (sc);
-    if (val == -1)
-        return EINVAL;
-    err = sysctl_handle_int(oidp, &val, 0, req);
-    if (err || req->newptr == NULL)
-        return (err);
-    if (val < 0 || val > 1)
-        return (EINVAL);
-    pcm1796_set_mute(sc, val);
+
+    if (req->newptr != NULL) {
+        if ((err = SYSCTL_IN(req, &val, sizeof(val))))
+            return err;
+        if (val < 0)
+            return EINVAL;
+        snd_mtxlock(sc->lock);
+        if (val > sc->midi_head - sc->midi_tail)
+            err = EINVAL;
+        else
+            sc->midi_tail += val;
+        snd_mtxunlock(sc->lock);
+        return err;
+    }
+    if (req->oldptr == NULL)
+        return SYSCTL_OUT(req, NULL, sizeof(sc->midi_events));
+
+    ev = malloc(sizeof(sc->midi_events), M_DEVBUF, M_WAITOK);
+    snd_mtxlock(sc->lock);
+    head = sc->midi_head;
+    tail = sc->midi_tail;
+    for (n = 0; tail != head; n++, tail++)
+        ev[n] = sc->midi_events[tail & (XONAR_MIDI_EVENTS - 1)];
+    snd_mtxunlock(sc->lock);
+
+    err = SYSCTL_OUT(req, ev, n * sizeof(ev[0]));
+    free(ev, M_DEVBUF);
     return err;
 }
 
+/* Turning DoP detection off mid-stream undoes its mute */
 static int
-sysctl_xonar_rec_monitor(SYSCTL_HANDLER_ARGS)
+sysctl_xonar_dop(SYSCTL_HANDLER_ARGS)
 {
     struct xonar_info *sc;
     device_t dev;
@@ -1086,18 +3338,22 @@ sysctl_xonar_rec_monitor(SYSCTL_HANDLER_ARGS)
     sc = pcm_getdevinfo(dev);
     if (sc == NULL)
         return EINVAL;
-    val = cmi8788_get_rec_monitor (sc);
+    val = sc->dop;
     err = sysctl_handle_int(oidp, &val, 0, req);
     if (err || req->newptr == NULL)
         return (err);
     if (val < 0 || val > 1)
         return (EINVAL);
-    cmi8788_set_rec_monitor(sc, val);
+    snd_mtxlock(sc->lock);
+    sc->dop = val;
+    if (!val)
+        xonar_dop_update(&sc->chan[XONAR_CHAN_MULTICH], 0, 0);
+    snd_mtxunlock(sc->lock);
     return err;
 }
 
 static int
-sysctl_xonar_inzd(SYSCTL_HANDLER_ARGS)
+sysctl_xonar_spdif_mirror(SYSCTL_HANDLER_ARGS)
 {
     struct xonar_info *sc;
     device_t dev;
@@ -1107,100 +3363,77 @@ sysctl_xonar_inzd(SYSCTL_HANDLER_ARGS)
     sc = pcm_getdevinfo(dev);
     if (sc == NULL)
         return EINVAL;
-    val = pcm1796_get_inzd (sc);
-    if (val == -1)
-        return EINVAL;
+    val = sc->spdif_mirror;
     err = sysctl_handle_int(oidp, &val, 0, req);
     if (err || req->newptr == NULL)
         return (err);
     if (val < 0 || val > 1)
         return (EINVAL);
-    pcm1796_set_inzd(sc, val);
+    snd_mtxlock(sc->lock);
+    sc->spdif_mirror = val;
+    xonar_spdif_route(sc);
+    snd_mtxunlock(sc->lock);
     return err;
 }
 
-
-static int
-sysctl_xonar_output(SYSCTL_HANDLER_ARGS) 
+/*
+ * Called when the S/PDIF receiver reports a change of signal, lock or
+ * rate. The rate comes from the incoming channel status.
+ */
+static void
+xonar_spdif_in_detect(struct xonar_info *sc)
 {
-    struct xonar_info *sc;
-    device_t dev;
-    int val, old_val, err, i;
-    char buf[20];
-    char *endptr;
-
-    dev = oidp->oid_arg1;
-    sc = pcm_getdevinfo(dev);
-    if (sc == NULL)
-        return EINVAL;
-    val = cmi8788_get_output (sc);
-
-    if (val < 0 || val >= ARRAY_SIZE (output_str))
-        return EINVAL;
-
-    strncpy (buf, output_str[val], sizeof(buf));
-    err = sysctl_handle_string(oidp, buf, sizeof(buf), req);
-    if (err || req->newptr == NULL)
-        return (err);
-
-    old_val = val;
-    if (buf[0] == '\0') return EINVAL;
-    val = strtol (buf, &endptr, 10);
-    if (*endptr != '\0') {
-        val = -1;
-        for (i = 0; i < ARRAY_SIZE (output_str); i++) {
-            if (strncmp (buf, output_str[i], sizeof (buf)) == 0) {
-                val = i;
-                break;
-            }
+    uint32_t func, status;
+    int i, rate = 0;
+
+    func = cmi8788_read_4(sc, SPDIF_FUNC);
+    /* Acknowledge by writing 1 to the pending interrupt bits only */
+    xonar_spdif_func(sc, func & SPDIF_INT_MASK, 0);
+
+    if (func & SPDIF_LOCK_STATUS) {
+        status = cmi8788_read_4(sc, SPDIFIN_CHAN_STAT);
+        status = (status & SPDIF_CS_IN_RATE_MASK) >> SPDIF_CS_IN_RATE_SHIFT;
+        for (i = 0; i < ARRAY_SIZE (spdif_cs_rates); i++) {
+            if (spdif_cs_rates[i] == status)
+                rate = xonar_rates[i];
         }
     }
-    if (val < 0 || val > ARRAY_SIZE (output_str))
-        return (EINVAL);
-    if (val != old_val) cmi8788_set_output(sc, val);
-    return err;
+
+    if (rate != sc->spdif_in_rate) {
+        XONAR_DEBUG("S/PDIF input rate %d\n", rate);
+        sc->spdif_in_rate = rate;
+        sc->spdif_in_caps.minspeed = rate ? rate : XONAR_RATE_MIN;
+        sc->spdif_in_caps.maxspeed = rate ? rate : XONAR_RATE_MAX;
+    }
 }
 
-static int
-sysctl_xonar_rolloff(SYSCTL_HANDLER_ARGS) 
+/* Sample the sense inputs and report what changed */
+static void
+xonar_gpio_task(void *arg, int pending)
 {
-    struct xonar_info *sc;
-    device_t dev;
-    int val, err, i;
-    char buf[20];
-    char *endptr;
-
-    dev = oidp->oid_arg1;
-    sc = pcm_getdevinfo(dev);
-    if (sc == NULL)
-        return EINVAL;
-    val = pcm1796_get_rolloff (sc);
-
-    if (val < 0 || val >= ARRAY_SIZE(rolloff_str))
-        return EINVAL;
+    struct xonar_info *sc = arg;
+    const struct xonar_model *hw = sc->hw;
+    uint16_t gpio;
+    uint8_t gpi;
+    int power = -1, power_changed;
 
-    strncpy (buf, rolloff_str[val], sizeof (buf));
-    err = sysctl_handle_string(oidp, buf, sizeof(buf), req);
-    if (err || req->newptr == NULL)
-        return (err);
+    snd_mtxlock(sc->lock);
+    gpio = cmi8788_read_2(sc, GPIO_DATA);
+    gpi = cmi8788_read_1(sc, GPI_DATA);
+    if (hw->power_gpio)
+        power = (gpio & hw->power_gpio) != 0;
+    else if (hw->power_gpi)
+        power = (gpi & hw->power_gpi) != 0;
+    /* The first look after attach only records the state */
+    power_changed = sc->ext_power != -1 && power != sc->ext_power;
+    sc->ext_power = power;
+    snd_mtxunlock(sc->lock);
 
-    if (buf[0] == '\0')
-        return EINVAL;
-    val = strtol (buf, &endptr, 10);
-    if (*endptr != '\0') {
-        val = -1;
-        for (i = 0; i < ARRAY_SIZE (rolloff_str); i++) {
-            if (strncmp (buf, rolloff_str[i], sizeof (buf)) == 0) {
-                val = i;
-                break;
-            }
-        }
+    if (power_changed) {
+        if (!power)
+            device_printf(sc->dev, "power cable is not connected\n");
+        xonar_notify(sc, "POWER", power);
     }
-
-    if ((val < 0) || (val > 1))
-        return EINVAL;
-    pcm1796_set_rolloff (sc, val);
-    return err;
 }
 
 static void
@@ -1208,18 +3441,61 @@ xonar_intr(void *p) {
     struct xonar_info *sc = p;
     struct xonar_chinfo *ch;
     unsigned int intstat;
+    uint64_t frames;
     int i;
 
     if ((intstat = cmi8788_read_2(sc, IRQ_STAT)) == 0)
         return;
 
+    if (intstat & IRQ_SPDIF_IN_DETECT) {
+        cmi8788_setandclear_2 (sc, IRQ_MASK, 0, IRQ_SPDIF_IN_DETECT);
+        xonar_spdif_in_detect(sc);
+        cmi8788_setandclear_2 (sc, IRQ_MASK, IRQ_SPDIF_IN_DETECT, 0);
+    }
+
+    if (intstat & IRQ_MIDI) {
+        snd_mtxlock(sc->lock);
+        if (sc->mpu_intr != NULL) {
+            cmi8788_setandclear_2 (sc, IRQ_MASK, 0, IRQ_MIDI);
+            cmi8788_setandclear_2 (sc, IRQ_MASK, IRQ_MIDI, 0);
+            sc->midi_time = sbinuptime();
+            sc->mpu_intr(sc->mpu);
+            sc->midi_time = 0;
+        }
+        snd_mtxunlock(sc->lock);
+    }
+
+    if (intstat & IRQ_GPIO) {
+        /* devctl allocates, so the pins are looked at in a task */
+        cmi8788_setandclear_2 (sc, IRQ_MASK, 0, IRQ_GPIO);
+        cmi8788_setandclear_2 (sc, IRQ_MASK, IRQ_GPIO, 0);
+        taskqueue_enqueue(taskqueue_thread, &sc->gpio_task);
+    }
+
     for (i=0; i < MAX_PORTS_PLAY+MAX_PORTS_REC; i++) {
         ch = &(sc->chan[i]);
         if ((ch->state == CHAN_STATE_ACTIVE) && (intstat & ch->irq_mask)) {
             /* Acknowledge the interrupt by disabling and enabling the irq */
             cmi8788_setandclear_2 (sc, IRQ_MASK, 0, ch->irq_mask);
             cmi8788_setandclear_2 (sc, IRQ_MASK, ch->irq_mask, 0);
+            if (ch->dac_type == 1) {
+                frames = ch->frag / AFMT_ALIGN(ch->fmt);
+                sc->samples_native += frames * sc->streams_native;
+                sc->samples_resampled += frames * sc->streams_resampled;
+                if (sc->dop) {
+                    snd_mtxlock(sc->lock);
+                    xonar_dop_update(ch, cmi8788_read_4(sc, MULTICH_ADDR) -
+                                     ch->phys_buf, 1);
+                    snd_mtxunlock(sc->lock);
+                }
+            }
             chn_intr(ch->channel);
+            if (ch->dir == PCMDIR_PLAY)
+                xonar_dma_sync(ch, BUS_DMASYNC_PREWRITE);
+            /* The channel may have stopped while chn_intr() ran */
+            snd_mtxlock(sc->lock);
+            xonar_status_chan(ch, ch->state == CHAN_STATE_ACTIVE, 1);
+            snd_mtxunlock(sc->lock);
         }
     }
 }
@@ -1228,21 +3504,15 @@ xonar_intr(void *p) {
 static int
 xonar_probe(device_t dev)
 {
-    int i;
-    uint16_t subvid, subid;
-
-    subvid = pci_get_subvendor(dev);
-    subid = pci_get_subdevice(dev);
+    const struct xonar_model *hw;
 
     if ((pci_get_vendor(dev) != CMEDIA_VENDOR_ID) || 
          (pci_get_device(dev) != CMEDIA_CMI8788))
         return (ENXIO);
 
-    for (i = 0; i < ARRAY_SIZE (xonar_hw); i++) {
-        if ((subvid == xonar_hw[i].vendor) &&
-            (subid  == xonar_hw[i].devid))
-            device_set_desc(dev, xonar_hw[i].desc);
-    }
+    hw = xonar_find_model(dev);
+    if (hw->desc != NULL)
+        device_set_desc(dev, hw->desc);
     return (BUS_PROBE_DEFAULT);
 }
 
@@ -1257,6 +3527,7 @@ xonar_attach(device_t dev)
 {
     struct xonar_info *sc;
     char status[SND_STATUSLEN];
+    const char *dma_mem;
     int i;
 
     sc = malloc(sizeof(*sc), M_DEVBUF, M_WAITOK | M_ZERO);
@@ -1267,6 +3538,16 @@ xonar_attach(device_t dev)
     pci_enable_io(dev, SYS_RES_IOPORT);
 
     sc->model = pci_get_subdevice(dev);
+    sc->hw = xonar_find_model(dev);
+    sc->rate_follow = 1;
+    callout_init_mtx(&sc->start_callout, sc->lock, 0);
+    TIMEOUT_TASK_INIT(taskqueue_thread, &sc->rate_task, 0, xonar_rate_task,
+                      &sc->chan[XONAR_CHAN_MULTICH]);
+    TIMEOUT_TASK_INIT(taskqueue_thread, &sc->idle_task, 0, xonar_idle_task, sc);
+    TIMEOUT_TASK_INIT(taskqueue_thread, &sc->relay_task, 0, xonar_relay_task, sc);
+    TASK_INIT(&sc->gpio_task, 0, xonar_gpio_task, sc);
+    TASK_INIT(&sc->dop_task, 0, xonar_dop_task, sc);
+    sc->ext_power = -1;
 
     sc->regid = PCIR_BAR(0);
     sc->regtype = SYS_RES_IOPORT;
@@ -1278,8 +3559,16 @@ xonar_attach(device_t dev)
     }
     sc->st = rman_get_bustag(sc->reg);
     sc->sh = rman_get_bushandle(sc->reg);
+    cmi8788_shadow_init(sc);
+
+    if (xonar_status_alloc(sc) != 0) {
+        device_printf(dev, "unable to allocate status page\n");
+        goto bad;
+    }
+    sc->status->version = XONAR_STATUS_VERSION;
 
     xonar_init(sc);
+    sc->status->output = cmi8788_get_output(sc);
 
     sc->irqid = 0;
     sc->irq = bus_alloc_resource_any(dev, SYS_RES_IRQ, &sc->irqid,
@@ -1289,6 +3578,18 @@ xonar_attach(device_t dev)
         device_printf(dev, "unable to map interrupt\n");
         goto bad;
     }
+    snd_mtxlock(sc->lock);
+    xonar_spdif_in_detect(sc);
+    cmi8788_setandclear_2 (sc, IRQ_MASK, IRQ_SPDIF_IN_DETECT, 0);
+    if (sc->hw->power_gpio | sc->hw->power_gpi) {
+        cmi8788_write_2 (sc, GPIO_IRQ_MASK, sc->hw->power_gpio);
+        cmi8788_write_1 (sc, GPI_IRQ_MASK, sc->hw->power_gpi);
+        cmi8788_setandclear_2 (sc, IRQ_MASK, IRQ_GPIO, 0);
+        taskqueue_enqueue(taskqueue_thread, &sc->gpio_task);
+    }
+    snd_mtxunlock(sc->lock);
+
+    xonar_midi_attach(sc);
 
     sc->bufmaxsz = sc->bufsz = pcm_getbuffersize(dev, 2048, DEFAULT_BUFFER_BYTES_MULTICH, 65536);
     if (xonar_create_dma_tag(&sc->dmat, 2*sc->bufsz, bus_get_dma_tag(dev), sc->lock) != 0) {
@@ -1296,9 +3597,22 @@ xonar_attach(device_t dev)
         goto bad;
     }
 
-    for (i=0; i<2; i++)
+    sc->dma_mem = XONAR_DMA_MEM_CACHED;
+    if (resource_string_value(device_get_name(dev), device_get_unit(dev),
+                              "dma_mem", &dma_mem) == 0) {
+        for (i = 0; i < ARRAY_SIZE(dma_mem_str); i++)
+            if (strcmp(dma_mem, dma_mem_str[i]) == 0)
+                break;
+        if (i < ARRAY_SIZE(dma_mem_str))
+            sc->dma_mem = i;
+        else
+            device_printf(dev, "unknown dma_mem \"%s\"\n", dma_mem);
+    }
+
+    for (i=0; i<MAX_PORTS_PLAY+MAX_PORTS_REC; i++)
     {
-        if (bus_dmamem_alloc (sc->dmat, &(sc->buf[i]), BUS_DMA_NOWAIT, &(sc->dma_map[i])) == ENOMEM) {
+        if (xonar_dma_alloc (sc, sc->dma_mem, &(sc->buf[i]), &(sc->dma_map[i]),
+                             BUS_DMA_NOWAIT) != 0) {
             device_printf (dev, "cannot alloc play buffer\n");
             goto bad;
         }
@@ -1313,24 +3627,38 @@ xonar_attach(device_t dev)
     if (mixer_init(dev, &xonar_mixer_class, sc))
         goto bad;
 
-    if (pcm_register(dev, sc, MAX_PORTS_PLAY, MAX_PORTS_REC))
+    /*
+     * This device only has the multichannel DACs and the ADC, so that
+     * a plain open never lands on a digital-only or front panel engine.
+     * S/PDIF and the AC97 engines get pcm devices of their own below.
+     */
+    if (pcm_register(dev, sc, 1, 1))
         goto bad;
-
-    for(i = 0; i < MAX_PORTS_PLAY; i++) {
-        pcm_addchan(dev, PCMDIR_PLAY, &xonar_chan_class, sc);
-        sc->pnum++;
-    }
-    sc->pnum = 0;
-    for(i = 0; i < MAX_PORTS_REC; i++) {
-        pcm_addchan(dev, PCMDIR_REC, &xonar_chan_class, sc);
-        sc->pnum++;
-    }
+    sc->pnum = XONAR_CHAN_MULTICH;
+    pcm_addchan(dev, PCMDIR_PLAY, &xonar_chan_class, sc);
+    pcm_addchan(dev, PCMDIR_REC, &xonar_chan_class, sc);
 
     snprintf(status, SND_STATUSLEN, "at io 0x%lx irq %ld %s",
              rman_get_start(sc->reg), rman_get_start(sc->irq),
              device_get_nameunit(device_get_parent(dev)));
     pcm_setstatus(dev, status);
 
+    /*
+     * The AC97 engines only make sense if there is a codec on the link:
+     * the front panel one for playback, any for recording. RECA is
+     * already taken when the ADC is on I2S ADC1.
+     */
+    xonar_add_pcm(sc, XONAR_CHAN_SPDIF);
+    if ((sc->ac97_codecs & AC97_CODEC1) ||
+        (sc->ac97_codecs && sc->hw->adc_type != 1))
+        xonar_add_pcm(sc, XONAR_CHAN_FPOUT);
+    bus_generic_attach(dev);
+
+    sc->status_dev = make_dev(&xonar_status_cdevsw, device_get_unit(dev),
+                              UID_ROOT, GID_WHEEL, 0444, "xonarstat%d",
+                              device_get_unit(dev));
+    sc->status_dev->si_drv1 = sc;
+
     SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
             SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
             "output", CTLTYPE_STRING | CTLFLAG_RW | CTLFLAG_ANYBODY, sc->dev,
@@ -1346,6 +3674,21 @@ xonar_attach(device_t dev)
             "monitor", CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_ANYBODY, sc->dev,
             sizeof(sc->dev), sysctl_xonar_rec_monitor, "I",
             "Enable recording monitor");
+    SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "monitor_source", CTLTYPE_STRING | CTLFLAG_RW | CTLFLAG_ANYBODY, sc->dev,
+            sizeof(sc->dev), sysctl_xonar_monitor_src, "A",
+            "Monitored input (line=0/mic=1/spdif=2)");
+    SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "monitor_atten", CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_ANYBODY, sc->dev,
+            sizeof(sc->dev), sysctl_xonar_monitor_atten, "I",
+            "Monitor attenuation in dB (0 or 6)");
+    SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "monitor_dest", CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_ANYBODY, sc->dev,
+            sizeof(sc->dev), sysctl_xonar_monitor_dest, "I",
+            "DAC pair the monitor is mixed into (0-3)");
     SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
             SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
             "mute", CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_ANYBODY, sc->dev,
@@ -1353,9 +3696,98 @@ xonar_attach(device_t dev)
             "Mute DAC");
     SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
             SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
-            "inzd", CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_ANYBODY, sc->dev,
-            sizeof(sc->dev), sysctl_xonar_inzd, "I",
-            "Infinite zero detect mute");
+            "exclusive", CTLTYPE_INT | CTLFLAG_RW, sc->dev,
+            sizeof(sc->dev), sysctl_xonar_exclusive, "I",
+            "Exclusive bitperfect playback without vchans");
+    SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "bitperfect_active", CTLTYPE_INT | CTLFLAG_RD, sc->dev,
+            sizeof(sc->dev), sysctl_xonar_bitperfect_active, "I",
+            "Current playback stream is bitperfect");
+    SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "shadow_check", CTLTYPE_INT | CTLFLAG_RW, sc->dev,
+            sizeof(sc->dev), sysctl_xonar_shadow_check, "I",
+            "Write 1 to compare the register shadow with the chip");
+    SYSCTL_ADD_STRING(device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "dma_mem", CTLFLAG_RD, dma_mem_str[sc->dma_mem], 0,
+            "DMA buffer memory type (hint.pcm.N.dma_mem)");
+    SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "dma_bench", CTLTYPE_STRING | CTLFLAG_RW, sc->dev,
+            sizeof(sc->dev), sysctl_xonar_dma_bench, "A",
+            "Write \"run\" to measure buffer copy throughput per DMA memory type, MB/s");
+    SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "spdif_mirror", CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_ANYBODY, sc->dev,
+            sizeof(sc->dev), sysctl_xonar_spdif_mirror, "I",
+            "Feed S/PDIF out from the front multichannel pair");
+    SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "start_at", CTLTYPE_S64 | CTLFLAG_RW, sc->dev,
+            sizeof(sc->dev), sysctl_xonar_start_at, "Q",
+            "Start DMA of the next triggered channels at this uptime (ns)");
+    SYSCTL_ADD_S64 (device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "start_error", CTLFLAG_RD, &sc->start_error,
+            0, "Last scheduled start, ns after the deadline");
+    SYSCTL_ADD_S64 (device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "start_latency", CTLFLAG_RD, &sc->start_latency,
+            0, "Last channel start, ns from trigger to DMA running");
+    SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "state", CTLTYPE_STRING | CTLFLAG_RW, sc->dev,
+            sizeof(sc->dev), sysctl_xonar_state, "A",
+            "All settings at once, for saving and restoring them");
+    SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "idle_timeout", CTLTYPE_INT | CTLFLAG_RW, sc->dev,
+            sizeof(sc->dev), sysctl_xonar_idle_timeout, "I",
+            "Power the DACs down after this many idle seconds, 0 never");
+    SYSCTL_ADD_INT (device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "idle", CTLFLAG_RD, &sc->idle,
+            0, "DACs are powered down");
+    SYSCTL_ADD_U64 (device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "wakeups", CTLFLAG_RD, &sc->wakeups,
+            0, "Wake ups from idle power down");
+    SYSCTL_ADD_S64 (device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "wake_cost", CTLFLAG_RD, &sc->wake_cost,
+            0, "Last wake up, ns added to the channel start");
+    if (sc->mpu != NULL) {
+        SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
+                SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+                "midi_input", CTLTYPE_OPAQUE | CTLFLAG_RW, sc->dev,
+                sizeof(sc->dev), sysctl_xonar_midi_input, "S,xonar_midi_event",
+                "MIDI bytes received with uptime in ns, write a count to consume");
+        SYSCTL_ADD_U64 (device_get_sysctl_ctx(sc->dev),
+                SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+                "midi_overruns", CTLFLAG_RD, &sc->midi_overruns,
+                0, "MIDI bytes not timestamped, midi_input was not consumed");
+    }
+    SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "dop", CTLTYPE_INT | CTLFLAG_RW, sc->dev,
+            sizeof(sc->dev), sysctl_xonar_dop, "I",
+            "Mute the DACs while the front pair carries DoP");
+    SYSCTL_ADD_INT (device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "dop_active", CTLFLAG_RD, &sc->dop_active,
+            0, "DoP seen on the front pair");
+    SYSCTL_ADD_INT (device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "spdif_in_rate", CTLFLAG_RD, &sc->spdif_in_rate,
+            0, "Incoming S/PDIF sample rate, 0 if not locked");
+    if (sc->hw->get_inzd != NULL)
+        SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->dev),
+                SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+                "inzd", CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_ANYBODY, sc->dev,
+                sizeof(sc->dev), sysctl_xonar_inzd, "I",
+                "Infinite zero detect mute");
     SYSCTL_ADD_UINT (device_get_sysctl_ctx(sc->dev),
             SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
             "vol_offset_hp", CTLFLAG_RW | CTLFLAG_ANYBODY, &sc->vol_offset_hp,
@@ -1376,6 +3808,18 @@ xonar_attach(device_t dev)
             SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
             "debug", CTLFLAG_RW | CTLFLAG_ANYBODY, &sc->debug,
             0, "Enable debug output");
+    SYSCTL_ADD_INT (device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "rate_follow", CTLFLAG_RW, &sc->rate_follow,
+            0, "Switch hardware rate to the rate most vchans use");
+    SYSCTL_ADD_U64 (device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "samples_native", CTLFLAG_RD, &sc->samples_native,
+            0, "Sample frames played at the hardware rate (estimate)");
+    SYSCTL_ADD_U64 (device_get_sysctl_ctx(sc->dev),
+            SYSCTL_CHILDREN(device_get_sysctl_tree(sc->dev)), OID_AUTO,
+            "samples_resampled", CTLFLAG_RD, &sc->samples_resampled,
+            0, "Sample frames resampled to the hardware rate (estimate)");
 
     return (0);
 bad:
@@ -1390,19 +3834,223 @@ xonar_detach(device_t dev)
     int r;
 
     sc = pcm_getdevinfo(dev);
-    r = pcm_unregister(dev);
+    r = bus_generic_detach(dev);
     if (r)
         return r;
+    if (sc->mpu != NULL && (r = mpu401_uninit(sc->mpu)) != 0)
+        return r;
+    r = pcm_unregister(dev);
+    if (r) {
+        /* Still attached, so give the MIDI port back */
+        xonar_midi_attach(sc);
+        return r;
+    }
+
+    /*
+     * No channel can be triggered any more. Once the interrupt handler
+     * is gone too, nothing queues the tasks again and they can be
+     * drained for good.
+     */
+    if (sc->ih) {
+        bus_teardown_intr(sc->dev, sc->irq, sc->ih);
+        sc->ih = NULL;
+    }
+    taskqueue_drain_timeout(taskqueue_thread, &sc->rate_task);
+    taskqueue_drain_timeout(taskqueue_thread, &sc->idle_task);
+    taskqueue_drain_timeout(taskqueue_thread, &sc->relay_task);
+    taskqueue_drain(taskqueue_thread, &sc->gpio_task);
+    taskqueue_drain(taskqueue_thread, &sc->dop_task);
+    callout_drain(&sc->start_callout);
 
     xonar_cleanup(sc);
     return (0);
 }
 
+/*
+ * The controller registers are shadowed and the codecs are write-only
+ * with cached registers, so suspend only has to stop the engines and
+ * save the few registers that also carry status.
+ */
+static int
+xonar_suspend(device_t dev)
+{
+    struct xonar_info *sc;
+    struct xonar_chinfo *ch;
+    int i;
+
+    sc = pcm_getdevinfo(dev);
+    snd_mtxlock(sc->lock);
+    sc->resume_start = 0;
+    for (i = 0; i < MAX_PORTS_PLAY + MAX_PORTS_REC; i++) {
+        ch = &sc->chan[i];
+        if (ch->state == CHAN_STATE_ACTIVE && !(sc->sync_start & ch->dma_start))
+            sc->resume_start |= ch->dma_start;
+    }
+    /* A scheduled start has missed its deadline, do it on resume */
+    if (callout_stop(&sc->start_callout) > 0) {
+        sc->resume_start |= sc->sync_start;
+        sc->sync_start = 0;
+    }
+    cmi8788_write_2(sc, DMA_START, 0);
+
+    sc->spdif_func = cmi8788_read_4(sc, SPDIF_FUNC) &
+        ~(SPDIF_SENSE_STATUS | SPDIF_LOCK_STATUS | SPDIF_INT_MASK);
+    sc->i2c_ctrl = cmi8788_read_2(sc, I2C_CTRL) & ~TWOWIRE_BUSY;
+    snd_mtxunlock(sc->lock);
+    return 0;
+}
+
+/*
+ * Replay the controller shadow and the codec caches instead of going
+ * through xonar_init(), then restart the engines that were running,
+ * all with one DMA_START write. They start over from the beginning of
+ * their buffers, which the sound system sees as the pointer moving on.
+ */
+static int
+xonar_resume(device_t dev)
+{
+    struct xonar_info *sc;
+    struct xonar_chinfo *ch;
+    int i, relay;
+
+    sc = pcm_getdevinfo(dev);
+    snd_mtxlock(sc->lock);
+    if (sc->ac97_codecs)
+        xonar_ac97_reset(sc);
+    if (sc->mpu != NULL) {
+        /* Back to UART mode before IRQ_MIDI is unmasked, drop the ack */
+        cmi8788_write_1(sc, MPU401_COMMAND, MPU401_CMD_UART);
+        DELAY(100);
+        for (i = 0; i < 16 && !(cmi8788_read_1(sc, MPU401_COMMAND) &
+                                MPU401_STAT_RX_EMPTY); i++)
+            cmi8788_read_1(sc, MPU401_DATA);
+    }
+    /*
+     * The output relay stays open until the clock and the DACs are
+     * programmed again, then it closes after the anti-pop delay.
+     */
+    relay = cmi8788_shadow_restore(sc, sc->hw->output_enable_gpio) &&
+        !sc->idle;
+    cmi8788_write_2(sc, I2C_CTRL, sc->i2c_ctrl);
+    cmi8788_write_4(sc, SPDIF_FUNC, sc->spdif_func);
+    sc->hw->resume(sc);
+
+    for (i = 0; i < MAX_PORTS_PLAY + MAX_PORTS_REC; i++) {
+        ch = &sc->chan[i];
+        ch->dma_valid = 0;
+        if (!(sc->resume_start & ch->dma_start) ||
+            ch->state != CHAN_STATE_ACTIVE)
+            continue;
+        if (ch->dir == PCMDIR_PLAY)
+            xonar_prepare_output(ch);
+        else
+            xonar_prepare_input(ch);
+        ch->dma_ran = 1;
+    }
+    cmi8788_setandclear_2(sc, DMA_START, sc->resume_start, 0);
+    sc->resume_start = 0;
+    snd_mtxunlock(sc->lock);
+    if (relay)
+        cmi8788_toggle_sound(sc, 1);
+
+    /* The AC97 codec has no cache, let the mixer set it up again */
+    if (sc->ac97_mixer != NULL) {
+        MIXER_REINIT(sc->ac97_mixer);
+        ac97_init(sc);
+        mixer_reinit(dev);
+    }
+    return 0;
+}
+
+/*
+ * S/PDIF and the AC97 engines are pcm children of the card, one per
+ * port, with the port's channels in the card's softc.
+ */
+static const char *xonar_pcm_desc[] = {
+    [XONAR_CHAN_SPDIF] = "S/PDIF",
+    [XONAR_CHAN_FPOUT] = "AC97 (front panel)",
+};
+
+static void
+xonar_add_pcm(struct xonar_info *sc, int port)
+{
+    device_t child;
+
+    child = device_add_child(sc->dev, "pcm", -1);
+    if (child == NULL) {
+        device_printf(sc->dev, "unable to add %s pcm device\n",
+                      xonar_pcm_desc[port]);
+        return;
+    }
+    device_set_ivars(child, (void *)(uintptr_t)port);
+}
+
+static int
+xonar_pcm_probe(device_t dev)
+{
+    char desc[64];
+    int port = (uintptr_t)device_get_ivars(dev);
+
+    if (device_get_driver(device_get_parent(dev)) != &cmi8788_driver)
+        return (ENXIO);
+    snprintf(desc, sizeof(desc), "%s %s",
+             device_get_desc(device_get_parent(dev)), xonar_pcm_desc[port]);
+    device_set_desc_copy(dev, desc);
+    return (BUS_PROBE_DEFAULT);
+}
+
+static int
+xonar_pcm_attach(device_t dev)
+{
+    struct xonar_info *sc = pcm_getdevinfo(device_get_parent(dev));
+    char status[SND_STATUSLEN];
+    int port = (uintptr_t)device_get_ivars(dev);
+    int nplay = 1, nrec = 1;
+
+    if (port == XONAR_CHAN_FPOUT) {
+        nplay = (sc->ac97_codecs & AC97_CODEC1) != 0;
+        nrec = sc->ac97_codecs && sc->hw->adc_type != 1;
+    }
+    if (pcm_register(dev, sc, nplay, nrec))
+        return (ENXIO);
+    sc->pnum = port;
+    if (nplay)
+        pcm_addchan(dev, PCMDIR_PLAY, &xonar_chan_class, sc);
+    if (nrec)
+        pcm_addchan(dev, PCMDIR_REC, &xonar_chan_class, sc);
+
+    snprintf(status, SND_STATUSLEN, "on %s",
+             device_get_nameunit(device_get_parent(dev)));
+    pcm_setstatus(dev, status);
+    return (0);
+}
+
+static int
+xonar_pcm_detach(device_t dev)
+{
+    return pcm_unregister(dev);
+}
+
+static device_method_t xonar_pcm_methods[] = {
+    DEVMETHOD(device_probe,         xonar_pcm_probe),
+    DEVMETHOD(device_attach,        xonar_pcm_attach),
+    DEVMETHOD(device_detach,        xonar_pcm_detach),
+    DEVMETHOD_END
+};
+
+static driver_t xonar_pcm_driver = {
+    "pcm",
+    xonar_pcm_methods,
+    PCM_SOFTC_SIZE,
+};
+
 static device_method_t cmi8788_methods[] = {
     /* Methods from the device interface */
     DEVMETHOD(device_probe,         xonar_probe),
     DEVMETHOD(device_attach,        xonar_attach),
     DEVMETHOD(device_detach,        xonar_detach),
+    DEVMETHOD(device_suspend,       xonar_suspend),
+    DEVMETHOD(device_resume,        xonar_resume),
     DEVMETHOD_END
 };
 
@@ -1415,3 +4063,4 @@ static driver_t cmi8788_driver = {
 DRIVER_MODULE(snd_cmi8788, pci, cmi8788_driver, NULL, NULL);
 MODULE_DEPEND(snd_cmi8788, sound, SOUND_MINVER, SOUND_PREFVER, SOUND_MAXVER);
 MODULE_VERSION(snd_cmi8788, 0);
+DRIVER_MODULE(snd_cmi8788_pcm, pcm, xonar_pcm_driver, NULL, NULL);
@@ -11,8 +11,14 @@
 #define CMEDIA_VENDOR_ID    0x13F6
 #define CMEDIA_CMI8788      0x8788
 
-#define MAX_PORTS_PLAY      1
-#define MAX_PORTS_REC       1
+#define MAX_PORTS_PLAY      3
+#define MAX_PORTS_REC       3
+
+/* Playback channels, in registration order */
+#define XONAR_CHAN_MULTICH  0
+#define XONAR_CHAN_SPDIF    1
+#define XONAR_CHAN_FPOUT    2
+#define XONAR_CHAN_SPDIF_IN (MAX_PORTS_PLAY + 1)
 
 /* FIXME: Is it useful anymore? */
 #if 0
@@ -28,6 +34,31 @@
 
 #define DEFAULT_BUFFER_BYTES_MULTICH (4 * 2048)
 
+/* DMA buffer memory types, hint.pcm.N.dma_mem */
+#define XONAR_DMA_MEM_CACHED    0   /* write-back, explicit syncs */
+#define XONAR_DMA_MEM_COHERENT  1   /* BUS_DMA_COHERENT */
+#define XONAR_DMA_MEM_WC        2   /* write-combining where supported */
+
+/* Received MIDI bytes kept with their arrival time, power of 2 */
+#define XONAR_MIDI_EVENTS       256
+
+/* One received MIDI byte, as returned by the midi_input sysctl */
+struct xonar_midi_event {
+    int64_t time;       /* uptime in ns at the interrupt */
+    uint8_t data;
+};
+
+/* DoP (DSD over PCM) markers, top byte of alternate 24-bit samples */
+#define DOP_MARKER_A            0x05
+#define DOP_MARKER_B            0xfa
+
+/* Layout version of the state sysctl, bump when fields change */
+#define XONAR_STATE_VERSION     1
+#define XONAR_STATE_FIELDS      15
+
+/* Bytes copied per buffer type by the dma_bench sysctl */
+#define XONAR_DMA_BENCH_BYTES   (64 << 20)
+
 /* Device IDs */
 #define ASUS_VENDOR_ID      0x1043
 #define SUBID_XONAR_D2      0x8269
@@ -42,6 +73,8 @@
  * CM8338 registers definition
  */
 
+#define CMI8788_REG_SPACE   0x100
+
 #define RECA_ADDR       0x00
 #define RECA_SIZE       0x04
 #define RECA_FRAG       0x06
@@ -61,7 +94,13 @@
 #define FPOUT_SIZE      0x34
 #define FPOUT_FRAG      0x36
 
+/* DMA engine bits in DMA_START, CHAN_RESET, IRQ_MASK and IRQ_STAT */
+#define CHANNEL_RECA        0x01
+#define CHANNEL_RECB        0x02
+#define CHANNEL_RECC        0x04
+#define CHANNEL_SPDIF       0x08
 #define CHANNEL_MULTICH     0x10
+#define CHANNEL_FPOUT       0x20
 
 #define DMA_START       0x40
 #define CHAN_RESET      0x42
@@ -73,17 +112,27 @@
 #define  MULTICH_MODE_8CH   0x03
 #define IRQ_MASK        0x44
 #define IRQ_STAT        0x46
+#define  IRQ_SPDIF_IN_DETECT    0x0100
+#define  IRQ_GPIO               0x0800  /* GPIO or GPI input changed */
+#define  IRQ_MIDI               0x1000  /* MPU-401 RX data or TX space */
 #define MISC_REG        0x48
 #define  MISC_PCI_MEM_W_1_CLOCK 0x20
 #define  MISC_MIDI      0x40
 #define REC_FORMAT      0x4A
+#define  RECA_FORMAT_MASK       0x03
+#define  RECC_FORMAT_MASK       0x30
 #define PLAY_FORMAT     0x4B
+#define  SPDIF_FORMAT_MASK      0x03
 #define  MULTICH_FORMAT_MASK    0x0C
+#define  FPOUT_FORMAT_MASK      0x30
 #define REC_MODE        0x4C
 #define FUNCTION        0x50
 
 #define  FUNCTION_RESET_CODEC   0x02
+#define  FUNCTION_2WIRE_SPI_MASK 0x40
+#define  FUNCTION_SPI           0x00
 #define  FUNCTION_2WIRE         0x40
+#define  FUNCTION_ENABLE_SPI_4_5 0x80
 
 #define I2S_MULTICH_FORMAT  0x60
 #define  I2S_MASTER         0x0100
@@ -110,8 +159,34 @@
 #define I2S_ADC3_FORMAT     0x66
 
 #define SPDIF_FUNC      0x70
+#define  SPDIF_OUT_ENABLE       0x00000002
+#define  SPDIF_LOOPBACK         0x00000004 /* in to out */
+#define  SPDIF_SENSE_MASK       0x00000008
+#define  SPDIF_LOCK_MASK        0x00000010
+#define  SPDIF_RATE_MASK        0x00000020
+#define  SPDIF_SENSE_STATUS     0x00000800
+#define  SPDIF_LOCK_STATUS      0x00001000
+#define  SPDIF_SENSE_INT        0x00002000 /* write 1 to clear */
+#define  SPDIF_LOCK_INT         0x00004000
+#define  SPDIF_RATE_INT         0x00008000
+#define  SPDIF_INT_MASK         (SPDIF_SENSE_INT | SPDIF_LOCK_INT | SPDIF_RATE_INT)
+#define  SPDIF_IN_CLOCK_MASK    0x00010000
+#define  SPDIF_IN_CLOCK_96      0x00000000
+#define  SPDIF_IN_CLOCK_192     0x00010000
+#define  SPDIF_OUT_RATE_MASK    0x07000000 /* I2S_FMT_RATE* */
+#define  SPDIF_OUT_RATE_SHIFT   24
 #define SPDIFOUT_CHAN_STAT  0x74
+#define  SPDIF_CS_NONAUDIO      0x00000002
+#define  SPDIF_CS_COPY          0x00000004
+#define  SPDIF_CS_PREEMPHASIS   0x00000008
+#define  SPDIF_CS_CATEGORY_SHIFT 4
+#define  SPDIF_CS_CATEGORY_PCM  (0x02 << SPDIF_CS_CATEGORY_SHIFT)
+#define  SPDIF_CS_ORIGINAL      0x00000800
+#define  SPDIF_CS_RATE_MASK     0x0000f000
+#define  SPDIF_CS_RATE_SHIFT    12
 #define SPDIFIN_CHAN_STAT   0x78
+#define  SPDIF_CS_IN_RATE_MASK  0x0f000000 /* byte 3 of the channel status */
+#define  SPDIF_CS_IN_RATE_SHIFT 24
 
 #define I2C_ADDR        0x90
 #define I2C_MAP         0x91
@@ -121,11 +196,25 @@
 #define  TWOWIRE_SPEED_FAST     0x100
 
 #define SPI_CONTROL     0x98
+#define  SPI_BUSY           0x01 /* read */
+#define  SPI_TRIGGER        0x01 /* write */
+#define  SPI_DATA_LENGTH_2  0x00
+#define  SPI_DATA_LENGTH_3  0x02
+#define  SPI_CLOCK_160      0x00 /* ns */
+#define  SPI_CLOCK_320      0x04
+#define  SPI_CLOCK_640      0x08
+#define  SPI_CLOCK_1280     0x0c
+#define  SPI_CODEC_SHIFT    4
+#define  SPI_CEN_LATCH_CLOCK_HI 0x80
 #define SPI_DATA        0x99
+#define SPI_DATA2       0x9A
+#define SPI_DATA3       0x9B
 
 #define MPU401_DATA     0xA0
 #define MPU401_COMMAND      0xA1
 #define MPU401_CONTROL      0xA2
+#define  MPU401_STAT_RX_EMPTY   0x80    /* status, read at MPU401_COMMAND */
+#define  MPU401_CMD_UART        0x3f
 
 #define GPI_DATA        0xA4
 #define GPI_IRQ_MASK        0xA5
@@ -145,10 +234,33 @@
 #define DEVICE_SENSE        0xAC
 
 #define PLAY_ROUTING        0xC0
+#define  SPDIF_SRC_MASK         0x00e0
+#define  SPDIF_SRC_SPDIF        0x0000
+#define  SPDIF_SRC_MULTICH_01   0x0020
 
 #define REC_ROUTING     0xC2
+#define  RECA_ROUTE_MASK        0x07
+#define  RECA_ROUTE_I2S_ADC1    0x00
+#define  RECA_ROUTE_AC97_0      0x01
+#define  RECA_ROUTE_AC97_1      0x02
+#define  RECB_ROUTE_MASK        0x18
+#define  RECB_ROUTE_I2S_ADC2    0x00
+#define  RECB_ROUTE_LOOPBACK    0x08 /* multichannel front pair */
 #define REC_MONITOR     0xC3
+#define  REC_MONITOR_A          0x01
+#define  REC_MONITOR_A_HALF     0x02 /* -6dB */
+#define  REC_MONITOR_B          0x04
+#define  REC_MONITOR_B_HALF     0x08
+#define  REC_MONITOR_C          0x10
+#define  REC_MONITOR_C_HALF     0x20
+#define  REC_MONITOR_MASK       0x3f
 #define MONITOR_ROUTING     0xC4
+#define  MONITOR_ROUTING_DEFAULT 0xE4 /* 2 bits per DAC pair, identity */
+#define  MONITOR_ROUTING_PAIR_MASK 0x03
+
+#define MONITOR_SRC_LINE    0
+#define MONITOR_SRC_MIC     1
+#define MONITOR_SRC_SPDIF   2
 
 #define AC97_CTRL       0xD0
 #define  AC97_COLD_RESET    0x0001
@@ -192,7 +304,32 @@
 #define XONAR_MCLOCK_512    0x20
 #define XONAR_MCLOCK_MASK   0x30
 
+/* PCM1796/CS4398 soft mute ramp length, in frames at the current rate */
+#define XONAR_SOFTMUTE_FRAMES   256
+
+/* CS53x1 ADC mode pins */
+#define GPIO_CS53x1_M_MASK      0x000c
+#define GPIO_CS53x1_M_SINGLE    0x0000
+#define GPIO_CS53x1_M_DOUBLE    0x0004
+#define GPIO_CS53x1_M_QUAD      0x0008
+
+/* D1/DX GPIO layout */
+#define XONAR_D1_OUTPUT_ENABLE  GPIO_PIN0
+#define XONAR_D1_FRONT_PANEL    GPIO_PIN1
+#define XONAR_D1_MAGIC          (GPIO_PIN6 | GPIO_PIN7)
+#define XONAR_D1_INPUT_ROUTE    GPIO_PIN8
+#define XONAR_DX_EXT_POWER      0x01 /* in GPI_DATA */
+
+/* D2/D2X GPIO layout */
+#define XONAR_D2_ALT            GPIO_PIN7
+#define XONAR_D2_OUTPUT_ENABLE  GPIO_PIN8
+#define XONAR_D2X_EXT_POWER     GPIO_PIN5
+
 /* PCM1796 defines */
+#define PCM1796_REG_BASE    16
+#define PCM1796_NREGS       6
+#define PCM1796_MAX_DACS    4
+
 /* register 16 */
 #define PCM1796_ATL         0xff
 
@@ -229,6 +366,7 @@
 #define PCM1796_CHSL        0x04
 #define PCM1796_MONO        0x08
 #define PCM1796_DFTH        0x10
+/* DSD input shares the BCK/DATA/LRCK pins, the CMI8788 can't drive it */
 #define PCM1796_DSD         0x20
 #define PCM1796_SRST        0x40
 
@@ -254,6 +392,31 @@
 #define CS4398_MISC_CTRL  0x08
 #define CS4398_MISC2_CTRL 0x09
 
+/* CS4398 Reg 02h */
+#define CS4398_FM_SINGLE  0x00      /* Single speed mode (up to 50kHz) */
+#define CS4398_FM_DOUBLE  0x01      /* Double speed mode (up to 100kHz) */
+#define CS4398_FM_QUAD    0x02      /* Quad speed mode (up to 200kHz) */
+#define CS4398_FM_MASK    0x03
+#define CS4398_DIF_LJUST  0x00
+
+/* CS4398 Reg 03h */
+#define CS4398_ATAPI_B_R  0x01
+#define CS4398_ATAPI_A_L  0x08
+
+/* CS4398 Reg 04h */
+#define CS4398_PAMUTE     0x80
+#define CS4398_MUTE_A     0x10
+#define CS4398_MUTE_B     0x08
+#define CS4398_MUTEP_LOW  0x02
+
+/* CS4398 Reg 07h */
+#define CS4398_SOFT_RAMP  0x80
+#define CS4398_ZERO_CROSS 0x40
+#define CS4398_RMP_UP     0x20
+#define CS4398_RMP_DN     0x10
+#define CS4398_FILT_SEL   0x04      /* Slow rolloff filter */
+
+/* CS4398 Reg 08h */
 #define CS4398_POWER_DOWN (1<<7)    /* Obvious */
 #define CS4398_CPEN   (1<<6)    /* Control Port Enable */
 #define CS4398_FREEZE     (1<<5)    /* Freezes registers, unfreeze to 
@@ -327,6 +490,12 @@
 
 /* CS4362A Reg 06h, 09h, 0Ch */
 /* ATAPI crap, does anyone still use analog CD playback? */
+#define CS4362A_ATAPI_B_R   0x01
+#define CS4362A_ATAPI_A_L   0x08
+#define CS4362A_FM_SINGLE   0x00
+#define CS4362A_FM_DOUBLE   0x40
+#define CS4362A_FM_QUAD     0x80
+#define CS4362A_FM_MASK     0xC0
 
 /* CS4362A Reg 07h, 08h, 0Ah, 0Bh, 0Dh, 0Eh */
 /* Volume registers */
@@ -340,6 +509,61 @@
 #define CS4362A_VOL(x) \
     (char)((x) == 0 ? 0xFF : (0x60 - ((x)*96/100)))
 
+#define OUTPUT_LINE         0
+#define OUTPUT_REAR_HP      1
+#define OUTPUT_HP           2
+#define OUTPUT_NUM          3
+
+#define XONAR_BUS_I2C       0
+#define XONAR_BUS_SPI       1
+
+struct xonar_info;
+struct pcmchan_caps;
+
+/*
+ * Model descriptor. It is selected once on attach and holds
+ * everything which differs between cards: codec operations,
+ * how the codecs are connected and GPIO layout.
+ */
+struct xonar_model {
+    uint16_t subid;
+    const char *desc;
+
+    void (*init)        (struct xonar_info *sc);
+    /* Replay the cached codec state after the card lost power */
+    void (*resume)      (struct xonar_info *sc);
+    void (*set_volume)  (struct xonar_info *sc, int left, int right);
+    int  (*get_mute)    (struct xonar_info *sc);
+    int  (*set_mute)    (struct xonar_info *sc, int mute);
+    int  (*get_rolloff) (struct xonar_info *sc);
+    int  (*set_rolloff) (struct xonar_info *sc, int rolloff);
+    void (*set_rate)    (struct xonar_info *sc, int speed);
+    void (*set_power)   (struct xonar_info *sc, int on);
+    /* Can be NULL */
+    int  (*get_inzd)    (struct xonar_info *sc);
+    int  (*set_inzd)    (struct xonar_info *sc, int inzd);
+
+    int dac_bus;
+    uint8_t front_dac;
+    uint8_t surr_dac;
+
+    uint16_t output_enable_gpio;
+    uint16_t input_route_gpio;
+    /* GPIO_DATA values for each OUTPUT_* within output_gpio_mask */
+    uint16_t output_gpio_mask;
+    uint16_t output_gpio[OUTPUT_NUM];
+    int outputs;                /* (1 << OUTPUT_*) mask */
+
+    /* External power sense, reported on change */
+    uint16_t power_gpio;        /* in GPIO_DATA, set when powered */
+    uint8_t power_gpi;          /* in GPI_DATA, set when powered */
+
+    int anti_pop_delay;         /* in ticks */
+    uint16_t mclk;
+    int adc_type;
+    struct pcmchan_caps *play_caps;
+};
+
 struct xonar_chinfo {
     struct snd_dbuf     *buffer;
     struct pcm_channel  *channel;
@@ -352,6 +576,11 @@ struct xonar_chinfo {
     int             irq_mask;
     int             state;
     int             blksz;
+    int             frag;
+
+    /* DMA registers as last programmed, see xonar_dma_program() */
+    uint32_t        dma_addr, dma_size, dma_frag;
+    int             dma_valid, dma_ran;
 };
 
 struct xonar_info {
@@ -368,14 +597,20 @@ struct xonar_info {
     void *ih;
     bus_space_tag_t st;
     bus_space_handle_t sh;
+    uint8_t regs[CMI8788_REG_SPACE];   /* control register shadow */
+    int shadow_bad;     /* mismatches found by the last shadow_check */
     bus_dma_tag_t   dmat;
-    bus_dmamap_t dma_map[2];
-    void* buf[2];
-    bus_addr_t phys[2];
+    bus_dmamap_t dma_map[MAX_PORTS_PLAY+MAX_PORTS_REC];
+    void* buf[MAX_PORTS_PLAY+MAX_PORTS_REC];
+    bus_addr_t phys[MAX_PORTS_PLAY+MAX_PORTS_REC];
+    int dma_mem;        /* XONAR_DMA_MEM_*, same for all buffers */
+    char dma_bench[128];    /* result of the last dma_bench run */
 
     uint16_t model;
+    const struct xonar_model *hw;
 
     int vol[2];
+    int pcm_vol[2];
     int vol_offset_hp;
     int vol_scale_hp;
     int vol_offset_line;
@@ -385,11 +620,78 @@ struct xonar_info {
     int pnum;
     struct xonar_chinfo chan[MAX_PORTS_PLAY+MAX_PORTS_REC];
 
-    int anti_pop_delay;
-    int output_control_gpio;
+    /* Hardware rate following and resampling statistics */
+    struct timeout_task rate_task;
+    int rate_follow;
+    int spdif_mirror;
+    int rec_loopback;
+    int sync_start;     /* DMA_START bits held back for a sync group */
+
+    /* Scheduled start: uptime deadline and how far off the start was */
+    struct callout start_callout;
+    sbintime_t start_at;
+    int64_t start_error;
+    int64_t start_latency;
+
+    /* Saved by suspend for what the register shadow does not cover */
+    uint32_t spdif_func;
+    uint16_t i2c_ctrl;
+    int resume_start;   /* DMA_START bits to restart on resume */
+
+    /* Idle power down, see xonar_idle_task() */
+    struct timeout_task idle_task, relay_task;
+    int idle_timeout;   /* seconds, 0 = never */
+    int idle;           /* DACs powered down, output relay open */
+    uint64_t wakeups;
+    int64_t wake_cost;  /* ns spent waking up in the last trigger */
+
+    /* GPIO/GPI input changes, see xonar_gpio_task() */
+    struct task gpio_task;
+    int ext_power;      /* -1 if the model can't tell */
+
+    /* MPU-401, bytes go through midi(4), see xonar_midi_read() */
+    struct mpu401 *mpu;
+    void (*mpu_intr)(struct mpu401 *);
+    sbintime_t midi_time;   /* interrupt time, 0 outside xonar_intr */
+    /* Ring of timestamped input, under the softc lock */
+    struct xonar_midi_event midi_events[XONAR_MIDI_EVENTS];
+    u_int midi_head, midi_tail;
+    uint64_t midi_overruns;
+
+    /* DoP on the multichannel front pair, see xonar_dop_update() */
+    int dop;            /* look for it */
+    int dop_active;     /* found in the last check */
+    int dop_muted;      /* the DACs were muted because of it */
+    struct task dop_task;
+
+    /* Status page for mmap(), see xonar_status.h */
+    struct xonar_status *status;
+    struct vm_object *status_obj;
+    struct vm_page *status_page;
+    struct cdev *status_dev;
+
+    /* Hardware input monitoring */
+    int monitor, monitor_src, monitor_atten, monitor_dest;
+
+    /* Incoming S/PDIF rate, 0 without lock; capture caps follow it */
+    int spdif_in_rate;
+    struct pcmchan_caps spdif_in_caps;
+    int streams_native, streams_resampled;
+    /* Estimates: each period times the stream counts of the last scan */
+    uint64_t samples_native, samples_resampled;
+
+    /* PCM1796 registers 16-21 for each DAC. D2/D2X DACs are write-only. */
+    uint8_t pcm1796_regs[PCM1796_MAX_DACS][PCM1796_NREGS];
+    int pcm1796_dacs;
+
+    /* Shadows of write-only CS4398/CS4362A registers (D1/DX) */
+    uint8_t cs4398_regs[CS4398_MISC2_CTRL+1];
+    uint8_t cs4362a_regs[CS4362A_CHIP_REV+1];
 
     struct ac97_info *ac97_codec;
+    int ac97_codecs;    /* AC97_CODEC0/1 found by xonar_init */
     struct snd_mixer *ac97_mixer;
+    struct snd_mixer *mixer;    /* ours, for recsrc changes from sysctls */
 
     int debug;
 };
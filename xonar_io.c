@@ -1,13 +1,99 @@
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/bus.h>
+#include <sys/endian.h>
 
 #include "xonar_io.h"
 #include "xonar.h"
 
+/*
+ * Control registers, which only change when we write them. They are
+ * kept in sc->regs, so reading them and set-and-clear on them cost no
+ * port reads. Everything else (DMA pointers, interrupt and bus status,
+ * the I2C/SPI/MPU-401/AC97 interfaces, S/PDIF receiver status) always
+ * goes to the chip.
+ */
+#define CMI8788_REG_LATCH   0x01    /* shadow is the output latch only */
+#define CMI8788_REG_SHADOW  0x02
+
+/* Shadowed registers: X(register, length, flags) */
+#define CMI8788_SHADOWED(X)                                         \
+    X(DMA_START,            2, 0)                                   \
+    X(MULTICH_MODE,         1, 0)                                   \
+    X(IRQ_MASK,             2, 0)                                   \
+    X(MISC_REG,             2, 0)                                   \
+    X(REC_FORMAT,           1, 0)                                   \
+    X(PLAY_FORMAT,          1, 0)                                   \
+    X(REC_MODE,             1, 0)                                   \
+    X(FUNCTION,             1, 0)                                   \
+    X(I2S_MULTICH_FORMAT,   2, 0)                                   \
+    X(I2S_ADC1_FORMAT,      2, 0)                                   \
+    X(I2S_ADC2_FORMAT,      2, 0)                                   \
+    X(I2S_ADC3_FORMAT,      2, 0)                                   \
+    X(SPDIFOUT_CHAN_STAT,   4, 0)                                   \
+    X(GPI_IRQ_MASK,         1, 0)                                   \
+    /* Input pins read back live, the outputs come from the shadow */ \
+    X(GPIO_DATA,            2, CMI8788_REG_LATCH)                   \
+    X(GPIO_CONTROL,         2, 0)                                   \
+    X(GPIO_IRQ_MASK,        2, 0)                                   \
+    X(PLAY_ROUTING,         2, 0)                                   \
+    X(REC_ROUTING,          1, 0)                                   \
+    X(REC_MONITOR,          1, 0)                                   \
+    X(MONITOR_ROUTING,      1, 0)                                   \
+    X(AC97_INTR_MASK,       1, 0)                                   \
+    X(AC97_OUT_CHAN_CONFIG, 4, 0)                                   \
+    X(AC97_IN_CHAN_CONFIG,  4, 0)
+
+#define SHADOWED_ENTRY(reg, len, flags) { reg, len, flags },
+static const struct {
+    uint8_t reg, len, flags;
+} cmi8788_shadowed[] = {
+    CMI8788_SHADOWED(SHADOWED_ENTRY)
+};
+
+/* Per byte CMI8788_REG_* flags, from the same list */
+#define SHADOWED_FLAGS(reg, len, flags) \
+    [(reg) ... (reg) + (len) - 1] = CMI8788_REG_SHADOW | (flags),
+static const uint8_t cmi8788_regflags[CMI8788_REG_SPACE] = {
+    CMI8788_SHADOWED(SHADOWED_FLAGS)
+};
+
+static int
+cmi8788_shadow_ok(int reg, int n, int flags)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if ((cmi8788_regflags[reg + i] & (CMI8788_REG_SHADOW | flags)) !=
+            CMI8788_REG_SHADOW)
+            return 0;
+    return 1;
+}
+
+static uint32_t
+cmi8788_shadow_get(struct xonar_info *sc, int reg, int n)
+{
+    switch (n) {
+    case 4: return le32dec (&sc->regs[reg]);
+    case 2: return le16dec (&sc->regs[reg]);
+    default: return sc->regs[reg];
+    }
+}
+
+static void
+cmi8788_shadow_put(struct xonar_info *sc, int reg, int n, uint32_t val)
+{
+    switch (n) {
+    case 4: le32enc (&sc->regs[reg], val); break;
+    case 2: le16enc (&sc->regs[reg], val); break;
+    default: sc->regs[reg] = val; break;
+    }
+}
+
 #define DEFINE_WRITE_N(name, n, type) void name ## _write_ ## n    \
     (struct xonar_info *sc, int reg, type data) {                  \
-        bus_space_write_ ## n (sc->st, sc->sh, reg, data);}
+        bus_space_write_ ## n (sc->st, sc->sh, reg, data);         \
+        name ## _shadow_put (sc, reg, n, data);}
 
 DEFINE_WRITE_N(cmi8788, 4, uint32_t)
 DEFINE_WRITE_N(cmi8788, 2, uint16_t)
@@ -15,15 +101,28 @@ DEFINE_WRITE_N(cmi8788, 1, uint8_t )
 
 #define DEFINE_READ_N(name, n, type) type name ## _read_ ## n      \
     (struct xonar_info *sc, int reg) {                             \
+        if (cmi8788_shadow_ok(reg, n, CMI8788_REG_LATCH))          \
+            return name ## _shadow_get (sc, reg, n);             \
         return bus_space_read_ ## n (sc->st, sc->sh, reg);}
 
 DEFINE_READ_N(cmi8788, 4, uint32_t)
 DEFINE_READ_N(cmi8788, 2, uint16_t)
 DEFINE_READ_N(cmi8788, 1, uint8_t )
 
+/* The value set-and-clear starts from: the shadow, or the chip */
+#define DEFINE_CURRENT_N(name, n, type) static type name ## _current_ ## n \
+    (struct xonar_info *sc, int reg) {                             \
+        if (cmi8788_shadow_ok(reg, n, 0))                          \
+            return name ## _shadow_get (sc, reg, n);             \
+        return bus_space_read_ ## n (sc->st, sc->sh, reg);}
+
+DEFINE_CURRENT_N(cmi8788, 4, uint32_t)
+DEFINE_CURRENT_N(cmi8788, 2, uint16_t)
+DEFINE_CURRENT_N(cmi8788, 1, uint8_t )
+
 #define DEFINE_SETANDCLEAR_N(name, n, type) void name ## _setandclear_ ## n \
     (struct xonar_info *sc, int reg, type set, type clear) {            \
-        type val = name ## _read_ ## n (sc, reg);                       \
+        type val = name ## _current_ ## n (sc, reg);                    \
             val &= ~clear; val |= set;                                  \
             name ## _write_ ## n (sc, reg, val);}
 
@@ -31,6 +130,97 @@ DEFINE_SETANDCLEAR_N (cmi8788, 4, uint32_t)
 DEFINE_SETANDCLEAR_N (cmi8788, 2, uint16_t)
 DEFINE_SETANDCLEAR_N (cmi8788, 1, uint8_t )
 
+/* Like setandclear, but the register is only written if it changes */
+#define DEFINE_UPDATE_N(name, n, type) int name ## _update_ ## n       \
+    (struct xonar_info *sc, int reg, type set, type clear) {            \
+        type old = name ## _current_ ## n (sc, reg);                    \
+        type val = (old & ~clear) | set;                                \
+            if (val == old) return 0;                                   \
+            name ## _write_ ## n (sc, reg, val); return 1;}
+
+DEFINE_UPDATE_N (cmi8788, 4, uint32_t)
+DEFINE_UPDATE_N (cmi8788, 2, uint16_t)
+DEFINE_UPDATE_N (cmi8788, 1, uint8_t )
+
+/* Load the shadow from the chip; called once the registers are mapped */
+void
+cmi8788_shadow_init (struct xonar_info *sc)
+{
+    int i, j, reg;
+
+    for (i = 0; i < nitems(cmi8788_shadowed); i++) {
+        reg = cmi8788_shadowed[i].reg;
+        for (j = 0; j < cmi8788_shadowed[i].len; j++)
+            sc->regs[reg + j] = bus_space_read_1 (sc->st, sc->sh, reg + j);
+    }
+}
+
+/*
+ * Write the whole shadow back after the chip lost power. DMA_START is
+ * left alone, the engines have to be programmed again first. The GPIO
+ * outputs in gpio_off are restored low, and the shadow follows; the
+ * ones of them that were high are returned.
+ */
+uint16_t
+cmi8788_shadow_restore (struct xonar_info *sc, uint16_t gpio_off)
+{
+    uint16_t gpio;
+    int i, reg;
+
+    gpio = cmi8788_shadow_get (sc, GPIO_DATA, 2);
+    cmi8788_shadow_put (sc, GPIO_DATA, 2, gpio & ~gpio_off);
+    for (i = 0; i < nitems(cmi8788_shadowed); i++) {
+        reg = cmi8788_shadowed[i].reg;
+        if (reg == DMA_START)
+            continue;
+        switch (cmi8788_shadowed[i].len) {
+        case 4:
+            bus_space_write_4 (sc->st, sc->sh, reg, cmi8788_shadow_get (sc, reg, 4));
+            break;
+        case 2:
+            bus_space_write_2 (sc->st, sc->sh, reg, cmi8788_shadow_get (sc, reg, 2));
+            break;
+        default:
+            bus_space_write_1 (sc->st, sc->sh, reg, sc->regs[reg]);
+            break;
+        }
+    }
+    return gpio & gpio_off;
+}
+
+/*
+ * Compare the shadow with the chip. Returns the number of registers
+ * that differ, and reports each of them.
+ */
+int
+cmi8788_shadow_check (struct xonar_info *sc)
+{
+    uint32_t hw, shadow, mask;
+    int i, reg, len, bad = 0;
+
+    for (i = 0; i < nitems(cmi8788_shadowed); i++) {
+        reg = cmi8788_shadowed[i].reg;
+        len = cmi8788_shadowed[i].len;
+        mask = 0xffffffff;
+        shadow = cmi8788_shadow_get (sc, reg, len);
+        if (len == 4)
+            hw = bus_space_read_4 (sc->st, sc->sh, reg);
+        else if (len == 2)
+            hw = bus_space_read_2 (sc->st, sc->sh, reg);
+        else
+            hw = bus_space_read_1 (sc->st, sc->sh, reg);
+        /* Only pins configured as outputs read back what was written */
+        if (cmi8788_shadowed[i].flags & CMI8788_REG_LATCH)
+            mask = cmi8788_shadow_get (sc, GPIO_CONTROL, 2);
+        if ((hw & mask) != (shadow & mask)) {
+            device_printf (sc->dev, "register 0x%02x: shadow 0x%x, chip 0x%x\n",
+                           reg, shadow & mask, hw & mask);
+            bad++;
+        }
+    }
+    return bad;
+}
+
 static int cmi8788_wait_i2c (struct xonar_info *sc)
 {
     int count = 50;
@@ -89,6 +279,79 @@ int cmi8788_read_i2c (struct xonar_info *sc, uint8_t codec_num,
     return res;
 }
 
+/*
+ * SPI transfers are short (16 bits at 160ns per bit for PCM1796), so
+ * we do not wait for completion after each one. The controller is
+ * polled only before the next transfer is started, which lets the
+ * caller queue a whole batch without fixed delays in between.
+ */
+static int cmi8788_wait_spi (struct xonar_info *sc)
+{
+    /* A 24-bit transfer takes about 40us, allow for a slow SPI clock */
+    int count = 200;
+
+    while ((cmi8788_read_1(sc, SPI_CONTROL) & SPI_BUSY) && (count > 0)) {
+        DELAY(1);
+        count--;
+    }
+    if (count == 0) {
+        device_printf (sc->dev, "spi timeout\n");
+        return -1;
+    }
+    return 0;
+}
+
+void cmi8788_spi_batch_init (struct cmi8788_spi_batch *batch)
+{
+    batch->count = 0;
+}
+
+int cmi8788_spi_batch_add (struct cmi8788_spi_batch *batch,
+                           uint8_t control, uint32_t data)
+{
+    if (batch->count == SPI_BATCH_MAX)
+        return -1;
+
+    batch->xfer[batch->count].control = control;
+    batch->xfer[batch->count].data = data;
+    batch->count++;
+    return 0;
+}
+
+int cmi8788_spi_batch_flush (struct xonar_info *sc,
+                             struct cmi8788_spi_batch *batch)
+{
+    uint8_t control;
+    uint32_t data;
+    int i, res = 0;
+
+    for (i = 0; i < batch->count; i++) {
+        res = cmi8788_wait_spi (sc);
+        if (res) break;
+
+        control = batch->xfer[i].control;
+        data = batch->xfer[i].data;
+        cmi8788_write_1(sc, SPI_DATA, data);
+        cmi8788_write_1(sc, SPI_DATA2, data >> 8);
+        if (control & SPI_DATA_LENGTH_3)
+            cmi8788_write_1(sc, SPI_DATA3, data >> 16);
+        /* the transfer starts here */
+        cmi8788_write_1(sc, SPI_CONTROL, control);
+    }
+    batch->count = 0;
+
+    return res;
+}
+
+int cmi8788_write_spi (struct xonar_info *sc, uint8_t control, uint32_t data)
+{
+    struct cmi8788_spi_batch batch;
+
+    cmi8788_spi_batch_init (&batch);
+    cmi8788_spi_batch_add (&batch, control, data);
+    return cmi8788_spi_batch_flush (sc, &batch);
+}
+
 uint32_t xonar_ac97_read (struct xonar_info *sc, int which, int reg)
 {
     uint32_t val;
@@ -18,11 +18,40 @@ void cmi8788_setandclear_2 (struct xonar_info *sc, int reg,
 void cmi8788_setandclear_1( struct xonar_info *sc, int reg,
                                    u_int8_t set, u_int8_t clear);
 
+int cmi8788_update_4 (struct xonar_info *sc, int reg,
+                      u_int32_t set, u_int32_t clear);
+int cmi8788_update_2 (struct xonar_info *sc, int reg,
+                      u_int16_t set, u_int16_t clear);
+int cmi8788_update_1 (struct xonar_info *sc, int reg,
+                      u_int8_t set, u_int8_t clear);
+
+void cmi8788_shadow_init (struct xonar_info *sc);
+int cmi8788_shadow_check (struct xonar_info *sc);
+uint16_t cmi8788_shadow_restore (struct xonar_info *sc, uint16_t gpio_off);
+
 int cmi8788_write_i2c (struct xonar_info *sc, uint8_t codec_num,
                        uint8_t reg, uint8_t data);
 int cmi8788_read_i2c (struct xonar_info *sc, uint8_t codec_num,
                       uint8_t reg);
 
+#define SPI_BATCH_MAX 32
+
+/* A set of SPI transfers to be issued back to back */
+struct cmi8788_spi_batch {
+    int count;
+    struct {
+        uint8_t control;
+        uint32_t data;
+    } xfer[SPI_BATCH_MAX];
+};
+
+void cmi8788_spi_batch_init (struct cmi8788_spi_batch *batch);
+int cmi8788_spi_batch_add (struct cmi8788_spi_batch *batch,
+                           uint8_t control, uint32_t data);
+int cmi8788_spi_batch_flush (struct xonar_info *sc,
+                             struct cmi8788_spi_batch *batch);
+int cmi8788_write_spi (struct xonar_info *sc, uint8_t control, uint32_t data);
+
 uint32_t xonar_ac97_read (struct xonar_info *sc, int which, int reg);
 void xonar_ac97_write (struct xonar_info *sc, int which, int reg, uint32_t data);
 #endif
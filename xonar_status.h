@@ -0,0 +1,61 @@
+#ifndef XONAR_STATUS_H
+#define XONAR_STATUS_H
+
+/*
+ * Read-only status page, one per card, mmap()ed from /dev/xonarstatN.
+ * The interrupt handler and the trigger keep it current, so position,
+ * xrun and state queries cost no system call.
+ *
+ * Writers make seq odd, update the page and make it even again. A
+ * reader copies the page and retries while seq was odd or changed,
+ * see xonar_status_read().
+ */
+
+#include <sys/types.h>
+
+#define XONAR_STATUS_VERSION    1
+#define XONAR_STATUS_CHANS      6   /* playback, then recording */
+
+struct xonar_status_chan {
+    uint32_t running;       /* DMA engine started */
+    uint32_t rate;          /* Hz */
+    uint32_t format;        /* AFMT_* */
+    uint32_t pos;           /* DMA position, bytes into the buffer */
+    uint32_t bufsz;         /* buffer size, bytes */
+    uint32_t period;        /* bytes between interrupts */
+    uint64_t time;          /* uptime of the last update, ns */
+    uint64_t periods;       /* interrupts since attach */
+    uint64_t xruns;         /* as counted by sound(4) */
+};
+
+struct xonar_status {
+    volatile uint32_t seq;
+    uint32_t version;       /* XONAR_STATUS_VERSION */
+    uint32_t output;        /* as the output sysctl */
+    uint32_t pad;
+    struct xonar_status_chan chan[XONAR_STATUS_CHANS];
+};
+
+#ifndef _KERNEL
+#include <string.h>
+#include <machine/atomic.h>
+
+/* Take a consistent copy of the mapped page */
+static __inline void
+xonar_status_read(const struct xonar_status *st, struct xonar_status *copy)
+{
+    uint32_t seq;
+
+    for (;;) {
+        seq = atomic_load_acq_32((volatile uint32_t *)&st->seq);
+        if (seq & 1)
+            continue;
+        memcpy(copy, (const void *)st, sizeof(*copy));
+        atomic_thread_fence_acq();
+        if (st->seq == seq)
+            break;
+    }
+}
+#endif
+
+#endif